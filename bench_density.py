@@ -0,0 +1,79 @@
+"""
+Density benchmark: how many run processes fit on one host.
+
+Starts N copies of ./run on the same checkpoint at once and reports their total
+resident (RSS) and proportional (PSS) memory, sampled while they run, and their
+aggregate tok/s. The weights are mapped read-only and shared, so PSS should grow
+by about one run state per process, not by one copy of the weights.
+
+$ python bench_density.py out/model.bin --procs 1 2 4 8 -- -n 256 -t 0
+"""
+import argparse
+import re
+import subprocess
+import sys
+import time
+
+# -----------------------------------------------------------------------------
+# memory accounting, from /proc (Linux)
+
+def read_memory(pid):
+    """ returns (rss, pss) of a process in kB, or None once it has exited """
+    try:
+        with open(f"/proc/{pid}/smaps_rollup") as f:
+            text = f.read()
+    except OSError:
+        return None
+    rss = re.search(r"^Rss:\s+(\d+) kB", text, re.M)
+    pss = re.search(r"^Pss:\s+(\d+) kB", text, re.M)
+    if not rss or not pss:
+        return None
+    return int(rss.group(1)), int(pss.group(1))
+
+# -----------------------------------------------------------------------------
+# one round of N processes
+
+def run_round(binary, checkpoint, n, extra, interval):
+    cmd = [binary, checkpoint] + extra
+    procs = [subprocess.Popen(cmd, stdout=subprocess.DEVNULL, stderr=subprocess.PIPE, text=True) for _ in range(n)]
+    peak_rss, peak_pss = 0, 0
+    while any(p.poll() is None for p in procs):
+        # total over the processes that are still up, the peak is what the host has to hold
+        rss, pss = 0, 0
+        for p in procs:
+            mem = read_memory(p.pid)
+            if mem:
+                rss += mem[0]
+                pss += mem[1]
+        peak_rss, peak_pss = max(peak_rss, rss), max(peak_pss, pss)
+        time.sleep(interval)
+    toks = []
+    for p in procs:
+        err = p.stderr.read()
+        m = re.search(r"achieved tok/s: ([0-9.]+)", err)
+        if p.returncode != 0 or not m:
+            raise RuntimeError(f"run failed (exit {p.returncode}):\n{err}")
+        toks.append(float(m.group(1)))
+    return peak_rss, peak_pss, toks
+
+# -----------------------------------------------------------------------------
+# CLI entrypoint
+
+if __name__ == "__main__":
+
+    parser = argparse.ArgumentParser()
+    parser.add_argument("checkpoint", type=str, help="the model checkpoint, .bin file")
+    parser.add_argument("--procs", type=int, nargs="+", default=[1, 2, 4, 8], help="process counts to run")
+    parser.add_argument("--binary", type=str, default="./run", help="the run binary")
+    parser.add_argument("--interval", type=float, default=0.05, help="memory sampling interval, in seconds")
+    # everything after -- goes to run as is
+    argv = sys.argv[1:]
+    split = argv.index("--") if "--" in argv else len(argv)
+    args = parser.parse_args(argv[:split])
+
+    # stats on, for the tok/s
+    extra = argv[split + 1:] + ["-x", "1"]
+    print(f"{'procs':>5} {'peak RSS MB':>12} {'peak PSS MB':>12} {'PSS/proc MB':>12} {'tok/s total':>12} {'tok/s/proc':>11}")
+    for n in args.procs:
+        rss, pss, toks = run_round(args.binary, args.checkpoint, n, extra, args.interval)
+        print(f"{n:>5} {rss / 1024:>12.1f} {pss / 1024:>12.1f} {pss / 1024 / n:>12.1f} {sum(toks):>12.1f} {sum(toks) / n:>11.1f}")
@@ -43,6 +43,23 @@ def serialize_int8(file, tensor):
     b = struct.pack(f'{len(d)}b', *d)
     file.write(b)
 
+def serialize_uint8(file, tensor):
+    """ writes one uint8 tensor to file that is open in wb mode """
+    d = tensor.detach().cpu().view(-1).numpy().astype(np.uint8)
+    b = struct.pack(f'{len(d)}B', *d)
+    file.write(b)
+
+def serialize_fp16(file, tensor):
+    """ writes one fp16 tensor to file that is open in wb mode """
+    d = tensor.detach().cpu().view(-1).to(torch.float16).numpy()
+    file.write(d.tobytes())
+
+def serialize_bf16(file, tensor):
+    """ writes one bf16 tensor to file that is open in wb mode """
+    # numpy has no bfloat16, write the raw 16 bit patterns
+    d = tensor.detach().cpu().view(-1).to(torch.bfloat16).view(torch.int16).numpy()
+    file.write(d.tobytes())
+
 def quantize_q80(w, group_size):
     """
     takes a tensor and returns the Q8_0 quantized version
@@ -69,6 +86,36 @@ def quantize_q80(w, group_size):
     maxerr = err.max().item()
     return int8val, scale, maxerr
 
+def quantize_q40(w, group_size):
+    """
+    takes a tensor and returns the Q4_0 quantized version
+    i.e. symmetric quantization into 4 bits, range [-7,7], packed two values per byte.
+    within every block of 32 values, byte k holds value k (offset by 8) in its low
+    nibble and value k+16 in its high nibble, so C can unpack a block with two masks
+    """
+    assert w.numel() % group_size == 0 and group_size % 32 == 0
+    w = w.float() # convert to float32
+    w = w.reshape(-1, group_size)
+    # find the max in each group
+    wmax = torch.abs(w).max(dim=1).values
+    # calculate the scaling factor such that float = quant * scale
+    scale = wmax / 7.0
+    # scale into range [-7, 7], all-zero groups stay zero
+    quant = w / torch.where(scale == 0, torch.ones_like(scale), scale)[:,None]
+    # round to nearest integer
+    int4val = torch.round(quant).clamp(-7, 7).to(torch.int8)
+    # dequantize by rescaling
+    fp32val = (int4val.float() * scale[:,None]).view(-1)
+    fp32valr = fp32val.reshape(-1, group_size)
+    # calculate the max error in each group
+    err = torch.abs(fp32valr - w).max(dim=1).values
+    # find the max error across all groups
+    maxerr = err.max().item()
+    # pack the nibbles
+    u = (int4val + 8).to(torch.uint8).reshape(-1, 2, 16)
+    packed = u[:,0,:] | (u[:,1,:] << 4)
+    return packed, scale, maxerr
+
 # -----------------------------------------------------------------------------
 # legacy
 
@@ -129,15 +176,12 @@ def legacy_export(model, filepath):
 # -----------------------------------------------------------------------------
 # new version
 
-def version1_export(model, filepath):
+def write_header(out_file, model, version, shared_classifier, group_size=None):
     """
-    Export the model weights in full float32 .bin file to be read from C.
-    This is same as legacy_export, but with a proper header.
+    Write the 256 byte header of the versioned formats: magic, version, the
+    7 config ints, the shared classifier flag and, for the quantized
+    versions, the group size. The rest is padded with zeros.
     """
-    version = 1
-
-    out_file = open(filepath, 'wb')
-    # first write out the header. the header will be 256 bytes
     # 1) write magic, which will be uint32 of "ak42" in ASCII
     out_file.write(struct.pack('I', 0x616b3432))
     # 2) write version, which will be int
@@ -150,17 +194,20 @@ def version1_export(model, filepath):
                                     n_kv_heads, p.vocab_size, p.max_seq_len)
     out_file.write(header)
     # 4) write some other flags
-    shared_classifier = torch.equal(model.tok_embeddings.weight, model.output.weight)
     out_file.write(struct.pack('B', int(shared_classifier)))
+    if group_size is not None:
+        out_file.write(struct.pack('i', group_size)) # group size used for quantization
     pad = 256 - out_file.tell() # pad rest with zeros; tell returns current pos
     assert pad >= 0
     out_file.write(b'\0' * pad)
 
-    # now let's write out all the params
+def matmul_weights(model, shared_classifier):
+    """
+    The weights the matmuls read, in the order of the versioned formats:
+    the embedding, the attention and the ffn weights of every layer, and
+    the classifier unless it is shared with the embedding.
+    """
     weights = [
-        *[layer.attention_norm.weight for layer in model.layers],
-        *[layer.ffn_norm.weight for layer in model.layers],
-        model.norm.weight,
         model.tok_embeddings.weight,
         *[layer.attention.wq.weight for layer in model.layers],
         *[layer.attention.wk.weight for layer in model.layers],
@@ -172,7 +219,56 @@ def version1_export(model, filepath):
     ]
     if not shared_classifier:
         weights.append(model.output.weight)
-    for w in weights:
+    return weights
+
+def write_norms(out_file, model):
+    """ Write the rmsnorm params, which every version keeps in fp32, ahead of the weights """
+    for layer in model.layers: # attention norms
+        serialize_fp32(out_file, layer.attention_norm.weight)
+    for layer in model.layers: # MLP norms
+        serialize_fp32(out_file, layer.ffn_norm.weight)
+    serialize_fp32(out_file, model.norm.weight) # final pre-classifier norm
+
+def write_quantized(out_file, weights, group_size, quantize, serialize, name):
+    """
+    Write weights quantized in groups of group_size by quantize, their
+    values by serialize, then all the fp32 scaling factors after them.
+    """
+    ew = []
+    scales = []
+    for i, w in enumerate(weights):
+        # quantize this weight
+        q, s, err = quantize(w, group_size)
+        # save the quantized values to file
+        serialize(out_file, q)
+        scales.append(s)  # we'll do all the scales after all the qs
+        # logging
+        ew.append((err, w.shape))
+        print(f"{i+1}/{len(weights)} quantized {tuple(w.shape)} to {name} with max error {err}")
+
+    # save the scaling factors in fp32 here
+    # this is done to keep all the weights contiquous, making pointer arithmetic easier in C
+    for s in scales:
+        serialize_fp32(out_file, s)
+
+    # print the highest error across all weights, should be very small, e.g. O(~0.001)
+    ew.sort(reverse=True)
+    print(f"max quantization group error across all weights: {ew[0][0]}")
+
+def version1_export(model, filepath):
+    """
+    Export the model weights in full float32 .bin file to be read from C.
+    This is same as legacy_export, but with a proper header.
+    """
+    version = 1
+
+    out_file = open(filepath, 'wb')
+    shared_classifier = torch.equal(model.tok_embeddings.weight, model.output.weight)
+    write_header(out_file, model, version, shared_classifier)
+
+    # now let's write out all the params
+    write_norms(out_file, model)
+    for w in matmul_weights(model, shared_classifier):
         serialize_fp32(out_file, w)
 
     # write to binary file
@@ -192,79 +288,78 @@ def version2_export(model, filepath, group_size=64):
     # let's first do some validation for this export type
     while model.params.dim % group_size != 0:
         group_size //= 2
-        print(f"BACKOFF: reducing group size to {group_size} to fit hidden_dim")
-    weights = [
-        model.tok_embeddings.weight,
-        *[layer.attention.wq.weight for layer in model.layers],
-        *[layer.attention.wk.weight for layer in model.layers],
-        *[layer.attention.wv.weight for layer in model.layers],
-        *[layer.attention.wo.weight for layer in model.layers],
-        *[layer.feed_forward.w1.weight for layer in model.layers],
-        *[layer.feed_forward.w2.weight for layer in model.layers],
-        *[layer.feed_forward.w3.weight for layer in model.layers],
-    ]
+        print(f"BACKOFF: reducing group size to {group_size} to fit dim")
     shared_classifier = torch.equal(model.tok_embeddings.weight, model.output.weight)
-    if not shared_classifier:
-        weights.append(model.output.weight)
-    for w in weights:
+    weights = matmul_weights(model, shared_classifier)
+    for i, w in enumerate(weights):
         assert w.numel() % group_size == 0, f"weight {i} has numel {w.numel()}, not a multiple of group_size {group_size}"
 
     # write
     out_file = open(filepath, 'wb')
-    # first write out the header. the header will be 256 bytes
-    # 1) write magic, which will be uint32 of "ak42" in ASCII
-    out_file.write(struct.pack('I', 0x616b3432))
-    # 2) write version, which will be int
-    out_file.write(struct.pack('i', version))
-    # 3) write the params, which will be 7 ints
-    p = model.params
-    hidden_dim = model.layers[0].feed_forward.w1.weight.shape[0]
-    n_kv_heads = p.n_heads if p.n_kv_heads is None else p.n_kv_heads
-    header = struct.pack('iiiiiii', p.dim, hidden_dim, p.n_layers, p.n_heads,
-                                    n_kv_heads, p.vocab_size, p.max_seq_len)
-    out_file.write(header)
-    # 4) write some other flags
-    out_file.write(struct.pack('B', int(shared_classifier)))
-    out_file.write(struct.pack('i', group_size)) # group size used for quantization
-    pad = 256 - out_file.tell() # pad rest with zeros; tell returns current pos
-    assert pad >= 0
-    out_file.write(b'\0' * pad)
+    write_header(out_file, model, version, shared_classifier, group_size)
     # now that the header is done, let's write out the model
+    write_norms(out_file, model)
+    write_quantized(out_file, weights, group_size, quantize_q80, serialize_int8, "Q8_0")
 
-    # first let's write out all the params that we are keeping in fp32: the norms
-    for layer in model.layers: # attention norms
-        serialize_fp32(out_file, layer.attention_norm.weight)
-    for layer in model.layers: # MLP norms
-        serialize_fp32(out_file, layer.ffn_norm.weight)
-    serialize_fp32(out_file, model.norm.weight) # final pre-classifier norm
+    # write to binary file
+    out_file.close()
+    print(f"wrote {filepath}")
 
-    # now let's write out all the params that we are quantizing to Q8_0
-    # note we skip classifier weights, which are shared with the embedding
-    ew = []
-    scales = []
-    for i, w in enumerate(weights):
-        # quantize this weight
-        q, s, err = quantize_q80(w, group_size)
-        # save the int8 weights to file
-        serialize_int8(out_file, q) # save the tensor in int8
-        scales.append(s)  # we'll do all the scales after all the qs
-        # logging
-        ew.append((err, w.shape))
-        print(f"{i+1}/{len(weights)} quantized {tuple(w.shape)} to Q8_0 with max error {err}")
 
-    # save the scaling factors in fp32 here
-    # this is done to keep all the weights contiquous, making pointer arithmetic easier in C
-    for s in scales:
-        serialize_fp32(out_file, s)
+def version3_export(model, filepath, group_size=64):
+    """
+    Export the model weights in Q4_0 into .bin file to be read from C.
+    Same layout as version2_export, but the matmul weights are symmetric
+    4-bit values in range [-7, 7], packed two per byte (see quantize_q40).
+    This halves the file again compared to Q8_0, at some loss in quality.
+    """
+    version = 3
 
-    # print the highest error across all weights, should be very small, e.g. O(~0.001)
-    ew.sort(reverse=True)
-    print(f"max quantization group error across all weights: {ew[0][0]}")
+    # let's first do some validation for this export type
+    # every matmul reads whole groups along its input, which is dim or hidden_dim
+    hidden_dim = model.layers[0].feed_forward.w1.weight.shape[0]
+    while model.params.dim % group_size != 0 or hidden_dim % group_size != 0:
+        group_size //= 2
+        print(f"BACKOFF: reducing group size to {group_size} to fit dim and hidden_dim")
+    assert group_size % 32 == 0, "dim and hidden_dim must be multiples of 32 for Q4_0"
+    shared_classifier = torch.equal(model.tok_embeddings.weight, model.output.weight)
+    weights = matmul_weights(model, shared_classifier)
+    for i, w in enumerate(weights):
+        assert w.numel() % group_size == 0, f"weight {i} has numel {w.numel()}, not a multiple of group_size {group_size}"
+
+    # write
+    out_file = open(filepath, 'wb')
+    write_header(out_file, model, version, shared_classifier, group_size)
+    write_norms(out_file, model)
+    # the packed 4-bit weights, then all their scaling factors
+    write_quantized(out_file, weights, group_size, quantize_q40, serialize_uint8, "Q4_0")
 
     # write to binary file
     out_file.close()
     print(f"wrote {filepath}")
 
+def version4_export(model, filepath, dtype=torch.float16):
+    """
+    Export the model weights in half precision into .bin file to be read from C.
+    Same layout as version1_export (the rmsnorm params stay fp32), but the matmul
+    weights are fp16 (version 4) or bf16 (version 5). Half the size of fp32 and
+    no quantization error beyond the 16 bit rounding.
+    """
+    version = 4 if dtype == torch.float16 else 5
+    serialize_half = serialize_fp16 if dtype == torch.float16 else serialize_bf16
+
+    out_file = open(filepath, 'wb')
+    shared_classifier = torch.equal(model.tok_embeddings.weight, model.output.weight)
+    write_header(out_file, model, version, shared_classifier)
+
+    # the norms are kept in fp32, then the 16 bit weights
+    write_norms(out_file, model)
+    for w in matmul_weights(model, shared_classifier):
+        serialize_half(out_file, w)
+
+    # write to binary file
+    out_file.close()
+    print(f"wrote {filepath}")
 
 # -----------------------------------------------------------------------------
 # Load / import functions
@@ -412,6 +507,12 @@ def model_export(model, filepath, version):
         version1_export(model, filepath)
     elif version == 2:
         version2_export(model, filepath)
+    elif version == 3:
+        version3_export(model, filepath)
+    elif version == 4:
+        version4_export(model, filepath, torch.float16)
+    elif version == 5:
+        version4_export(model, filepath, torch.bfloat16)
     else:
         raise ValueError(f"unknown version {version}")
 
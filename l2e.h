@@ -0,0 +1,58 @@
+/* libl2e: Llama 2 Everywhere as a library
+   The model is opened once and shared read-only by any number of contexts. Every context owns its
+   run state, kv cache, sampler and rng, so contexts generate independently, also on different threads.
+   Build with `make lib`, link with -ll2e -lm -pthread.
+
+       L2EModel* m = l2e_model_open("model.bin", "tokenizer.bin", NULL);
+       L2EContext* c = l2e_context_new(m, 42);
+       l2e_generate(c, "Once upon a time", 256, 1.0f, 0.9f, print_piece, NULL);
+       l2e_context_free(c);
+       l2e_model_close(m);
+*/
+
+#ifndef L2E_H
+#define L2E_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if defined(_WIN32)
+#define L2E_API
+#else
+#define L2E_API __attribute__((visibility("default")))
+#endif
+
+typedef struct L2EModel L2EModel;
+typedef struct L2EContext L2EContext;
+
+typedef struct {
+    int seq_len;  // context length, 0 = the trained one
+    int kv_type;  // kv cache storage, 0 = fp32, 1 = fp16, 2 = int8
+    int sinks;    // stream past seq_len, keeping this many attention sink tokens, 0 = off
+    int threads;  // THREADS builds: workers of the process wide thread pool, 0 = one per cpu
+} L2EOptions;
+
+// called with every generated piece of text. return nonzero to stop the generation
+typedef int (*L2ETokenFn)(const char* piece, void* user);
+
+// map the checkpoint and load the tokenizer. opt NULL = the defaults. NULL if a file can't be opened
+L2E_API L2EModel* l2e_model_open(const char* checkpoint_path, const char* tokenizer_path, const L2EOptions* opt);
+// all contexts of the model must be freed before
+L2E_API void l2e_model_close(L2EModel* m);
+
+// a context generating from m, its rng seeded with seed (0 = time)
+L2E_API L2EContext* l2e_context_new(L2EModel* m, unsigned long long seed);
+L2E_API void l2e_context_free(L2EContext* c);
+
+// generate from prompt (NULL = none), starting over at position 0. steps counts the prompt tokens
+// too, as run -n does: 0 = the context length, or no limit while streaming. temperature 0 = greedy,
+// topp in (0, 1) = nucleus sampling. returns the number of generated tokens
+L2E_API int l2e_generate(L2EContext* c, const char* prompt, int steps, float temperature, float topp,
+                         L2ETokenFn on_token, void* user);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // L2E_H
@@ -123,22 +123,54 @@ __static_yoink("zipos");
 #define ACCEL(VAR) MK_PRAGMA(acc parallel loop private(VAR))
 #endif
 
+// NUMA placement (-D NUMA, Linux only) is built on the thread pool
+#if defined(NUMA) && !defined(THREADS)
+#define THREADS
+#endif
+
 // ----------------------------------------------------------------------------
 // Standard Headers
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <ctype.h>
+#include <limits.h>
+#include <stddef.h>
 #include <time.h>
 #include <math.h>
 #include <string.h>
 #include <fcntl.h>
+#include <sys/stat.h>
 #if defined _WIN32
     #include "win.h"
 #else
     #include <unistd.h>
     #include <sys/mman.h>
 #endif
+#if defined(THREADS) || defined(L2E_LIB)
+    #include <pthread.h>
+#endif
+#ifdef THREADS
+    #include <sched.h>
+    #ifdef __linux__
+    #include <linux/futex.h>
+    #include <sys/syscall.h>
+    #endif
+#endif
+#if defined(OPENMP) && defined(_OPENMP)
+    #include <omp.h>
+#endif
+#if !defined(_WIN32) && !defined(COSMO_ZIP) && !defined(INC_BIN) && !defined(STRLIT) && !defined(L2E_LIB)
+    #define SERVER // the --serve http server, command line builds on posix systems
+    #include <signal.h>
+    #include <poll.h>
+    #include <sys/socket.h>
+    #include <netinet/in.h>
+    #include <netinet/tcp.h>
+    #include <strings.h>
+    #include <errno.h>
+#endif
 // ----------------------------------------------------------------------------
 // Transformer model
 
@@ -152,27 +184,114 @@ typedef struct {
     int seq_len; // max sequence length
 } Config;
 
+// ----------------------------------------------------------------------------
+// Checkpoint versions and weight storage
+// v0: legacy llama2.c layout, 28 byte Config header, all fp32
+// v1: 256 byte header (magic, version, Config, shared classifier flag), all fp32
+// v2: 256 byte header (+ group size), fp32 rmsnorm weights, Q8_0 matmul weights
+// v3: same as v2, but Q4_0 matmul weights
+// v4: same as v1, but fp16 matmul weights
+// v5: same as v1, but bf16 matmul weights
+
+#define CHECKPOINT_MAGIC 0x616b3432 // "ak42" in ASCII
+#define CHECKPOINT_HEADER_SIZE 256  // size of the v1+ header, in bytes
+#define WEIGHT_ALIGN 64             // v1+ weights are kept aligned to this many bytes (a cache line)
+#ifndef PREFILL_BATCH
+#define PREFILL_BATCH 32            // prompt positions forward_batch() pushes through the model at once
+#endif
+#ifndef KV_PAGE
+#define KV_PAGE 64                  // positions per kv cache page, pages are allocated as generation reaches them
+#endif
+#define Q4_BLOCK 32                 // Q4_0 packing block: byte k holds value k (low nibble) and k+16 (high)
+#define MATMUL_ROWS 4               // rows handed to a kernel at a time, also the unit the threads split matmuls in
+#define PANEL_ROWS 4                // repacked weights interleave this many rows, what the SIMD kernels walk per pass
+#define PANEL_BYTES 64              // ... in chunks of this many bytes of each row
+#define PANEL_MAGIC 0x6c32656b      // "ke2l", repack cache files
+#define SESSION_MAGIC 0x6c326573    // "l2es", session snapshots
+
+typedef enum {
+    WT_FP32 = 0, // plain float32
+    WT_Q8_0 = 1, // symmetric int8 in [-127,127], one fp32 scale per group of gs values
+    WT_Q4_0 = 2, // symmetric 4-bit in [-7,7] stored +8 as nibbles, one fp32 scale per group
+    WT_F16 = 3,  // IEEE half precision
+    WT_BF16 = 4, // bfloat16, the upper half of a float32
+} WeightType;
+
+static inline int is_quantized(int type) {
+    // quantized types have scales, and take x quantized to int8
+    return type == WT_Q8_0 || type == WT_Q4_0;
+}
+
+typedef struct {
+    void* q;   // weight values, element type depends on type
+    float* s;  // scaling factors, one per group (quantized types only)
+    int type;  // WeightType
+    int gs;    // quantization group size (quantized types only)
+    size_t n;  // number of values
+    int panel; // rows per interleaved panel once repacked (PANEL_ROWS), 0 = plain row-major
+} QuantizedTensor;
+
 typedef struct {
     // token embedding table
-    float* token_embedding_table;    // (vocab_size, dim)
+    QuantizedTensor* token_embedding_table;    // (vocab_size, dim)
     // weights for rmsnorms
     float* rms_att_weight; // (layer, dim) rmsnorm weights
     float* rms_ffn_weight; // (layer, dim)
-    // weights for matmuls. note dim == n_heads * head_size
-    float* wq; // (layer, dim, n_heads * head_size)
-    float* wk; // (layer, dim, n_kv_heads * head_size)
-    float* wv; // (layer, dim, n_kv_heads * head_size)
-    float* wo; // (layer, n_heads * head_size, dim)
+    // weights for matmuls, one tensor per layer. note dim == n_heads * head_size
+    QuantizedTensor* wq; // (layer, dim, n_heads * head_size)
+    QuantizedTensor* wk; // (layer, dim, n_kv_heads * head_size)
+    QuantizedTensor* wv; // (layer, dim, n_kv_heads * head_size)
+    QuantizedTensor* wo; // (layer, n_heads * head_size, dim)
     // weights for ffn
-    float* w1; // (layer, hidden_dim, dim)
-    float* w2; // (layer, dim, hidden_dim)
-    float* w3; // (layer, hidden_dim, dim)
+    QuantizedTensor* w1; // (layer, hidden_dim, dim)
+    QuantizedTensor* w2; // (layer, dim, hidden_dim)
+    QuantizedTensor* w3; // (layer, hidden_dim, dim)
     // final rmsnorm
     float* rms_final_weight; // (dim,)
     // (optional) classifier weights for the logits, on the last layer
-    float* wcls;
+    QuantizedTensor* wcls;
+    // (optional) wq, wk and wv stacked into one matrix per layer at load time
+    QuantizedTensor* wqkv; // (layer, dim + 2 * n_kv_heads * head_size, dim)
+    // buffers the weights were copied into at load time, released by free_weights()
+    void* aligned_copy; // aligned copy, only used when the checkpoint could not be mapped aligned
+    void* qkv_copy;     // values of wqkv
+    float* qkv_scales;  // scales of wqkv
+    void* panel_copy;   // repacked image of all the weights, see repack_weights()
+    void* panel_map;    // the same image, mapped from the repack cache file
+    size_t panel_map_size;
+    void* anon_copy;    // all the weights moved to fresh pages, see copy_weights()
+    size_t anon_copy_size;
+    int anon_backing;   // the PageBacking anon_copy got
 } TransformerWeights;
 
+typedef enum { KV_FP32 = 0, KV_FP16 = 1, KV_Q8 = 2 } KVType;
+
+typedef struct {
+    // keys and values of every layer and timestep, in pages of KV_PAGE timesteps that are allocated
+    // when the first of them is written. a row is the kv_dim values of one (layer, timestep), stored
+    // as a KVType. KV_Q8 rows are int8 with one scale per kv head, see kv_store().
+    // a page holds, for every layer: keys (KV_PAGE, kv_dim), values (KV_PAGE, kv_dim), then for KV_Q8
+    // key scales (KV_PAGE, n_kv_heads) and value scales (KV_PAGE, n_kv_heads).
+    // rows are slots, see kv_slot(): position pos is slot pos, unless streaming
+    int type;
+    int kv_dim, head_size, n_layers, seq_len;
+    int n_sink, window;  // streaming: slots [0, n_sink) keep the first positions, the next window slots are a ring
+    char** pages;       // page table, (seq_len / KV_PAGE rounded up,), NULL until written
+    int n_pages;        // entries in the page table
+    int n_alloc;        // pages allocated
+    size_t rows_bytes;  // of the keys (or values) of one layer in a page
+    size_t layer_bytes; // of one layer in a page, WEIGHT_ALIGN aligned
+    int lock;           // mlock pages as they are allocated
+    int lock_failed;    // an mlock failed and was reported, see lock_warning()
+    int huge;           // the PageBacking asked for the slab
+    char* slab;         // page i is at slab + i * kv_page_bytes(), mapped with the first page, see kv_alloc_page()
+    size_t slab_size;
+    int slab_backing;   // the PageBacking the slab got
+    char* map;          // a restored session the pages point into, see load_session(). they are not freed one by one
+    size_t map_size;
+    char* borrowed;     // per page, 1 = another cache's, shared read-only until the first write copies it. see kv_fork()
+} KVCache;
+
 typedef struct {
     // current wave of activations
     float *x; // activation at current time stamp (dim,)
@@ -185,11 +304,29 @@ typedef struct {
     float *v; // value (dim,)
     float *att; // buffer for scores/attention values (n_heads, seq_len)
     float *logits; // output logits
+    // cos and sin of every RoPE frequency at every position (seq_len, head_size/2, 2)
+    float *rope;
+    // the same activations for a block of prompt positions, see forward_batch()
+    float *px; // (PREFILL_BATCH, dim)
+    float *pxb; // (PREFILL_BATCH, dim)
+    float *pxb2; // (PREFILL_BATCH, dim)
+    float *pqkv; // q, k and v of each position (PREFILL_BATCH, dim + 2 * kv_dim)
+    float *phb; // (PREFILL_BATCH, hidden_dim)
+    float *phb2; // (PREFILL_BATCH, hidden_dim)
     // kv cache
-    float* key_cache;   // (layer, seq_len, dim)
-    float* value_cache; // (layer, seq_len, dim)
+    KVCache kv;
+    // all of the above are carved out of this one block
+    void* arena;
+    size_t arena_size;
+    int arena_backing; // the PageBacking the arena got
 } RunState;
 
+typedef enum { ROPE_NONE = 0, ROPE_LINEAR = 1, ROPE_NTK = 2 } RopeScaling;
+
+typedef enum { PAGES_4K = 0, PAGES_THP = 1, PAGES_HUGETLB = 2 } PageBacking;
+
+typedef enum { WARMUP_NONE = 0, WARMUP_ADVISE = 1, WARMUP_TOUCH = 2 } Warmup;
+
 typedef struct {
     Config config; // the hyperparameters of the architecture (the blueprint)
     TransformerWeights weights; // the weights of the model
@@ -197,6 +334,20 @@ typedef struct {
     RunState state; // buffers for the "wave" of activations in the forward pass
     RunState dstate;
     // some more state needed to properly clean up the memory mapping (sigh)
+    int version; // checkpoint version, see export.py
+    // load-time options, set these before build_transformer()
+    int fuse_qkv; // stack wq, wk and wv into one matrix per layer
+    int repack; // interleave the matmul weights into panels for the SIMD kernels
+    int seq_len; // context length to run with, 0 = the trained one
+    int rope_scaling; // how RoPE reaches a seq_len above the trained one, a RopeScaling
+    int numa; // give every numa node its own copy of the weight rows its threads compute
+    int huge; // pages for the run state and the weights, a PageBacking: PAGES_HUGETLB copies the weights
+    int warmup; // how to page the weights in at load, a Warmup
+    int mlock; // lock the weights and the run state in memory
+    int kv_type; // storage of the kv cache, a KVType
+    int sinks; // stream past seq_len, keeping this many attention sink positions plus a sliding window. 0 = off
+    int stats; // report load-time notes on stderr, e.g. a repack cache that could not be written
+    int map_backing; // the PageBacking asked for the checkpoint mapping
     int fd; // file descriptor for memory mapping
     float* data; // memory mapped data pointer
     float* ddata;
@@ -206,154 +357,795 @@ typedef struct {
     ssize_t dfile_size; // size of the checkpoint train file in bytes
 } Transformer;
 
-void malloc_run_state(RunState* s, Config* p) {
-    // we calloc instead of malloc to keep valgrind happy
-    int kv_dim = (p->dim * p->n_kv_heads) / p->n_heads;
-    s->x = calloc(p->dim, sizeof(float));
-    s->xb = calloc(p->dim, sizeof(float));
-    s->xb2 = calloc(p->dim, sizeof(float));
-    s->hb = calloc(p->hidden_dim, sizeof(float));
-    s->hb2 = calloc(p->hidden_dim, sizeof(float));
-    s->q = calloc(p->dim, sizeof(float));
-    s->k = calloc(kv_dim, sizeof(float));
-    s->v = calloc(kv_dim, sizeof(float));
-    s->att = calloc(p->n_heads * p->seq_len, sizeof(float));
-    s->logits = calloc(p->vocab_size, sizeof(float));
-    s->key_cache = calloc(p->n_layers * p->seq_len * kv_dim, sizeof(float));
-    s->value_cache = calloc(p->n_layers * p->seq_len * kv_dim, sizeof(float));
-    // ensure all mallocs went fine
-    if (!s->x || !s->xb || !s->xb2 || !s->hb || !s->hb2 || !s->q
-     || !s->k || !s->v || !s->att || !s->logits || !s->key_cache
-     || !s->value_cache) {
-        fprintf(stderr, "malloc failed!\n");
-        exit(EXIT_FAILURE);
+#define HUGE_PAGE_SIZE (2 << 20) // explicit huge pages are asked for in multiples of this
+
+static int advise_huge(void* p, size_t size) {
+    // ask for transparent huge pages over the mapping [p, p + size), returns the PageBacking asked for.
+    // the kernel may still use 4 KB pages, see huge_page_bytes()
+#ifdef MADV_HUGEPAGE
+    char mode[128] = "";
+    FILE* f = fopen("/sys/kernel/mm/transparent_hugepage/enabled", "r");
+    if (f) {
+        if (!fgets(mode, sizeof(mode), f)) { mode[0] = '\0'; }
+        fclose(f);
+    }
+    if (mode[0] && !strstr(mode, "[never]") && madvise(p, size, MADV_HUGEPAGE) == 0) { return PAGES_THP; }
+#endif
+    return PAGES_4K;
+}
+
+void* alloc_pages(size_t* size, int huge, int* backing) {
+    // zeroed anonymous memory for *size bytes, on the pages asked for (a PageBacking) or the next best
+    // ones the system has. *size becomes the size mapped and *backing the pages it could ask for, free
+    // with munmap()
+#ifdef MAP_HUGETLB
+    if (huge == PAGES_HUGETLB) {
+        // fails unless enough pages are reserved in /proc/sys/vm/nr_hugepages, so no fault later on
+        size_t s = (*size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+        void* p = mmap(NULL, s, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p != MAP_FAILED) { *size = s; *backing = PAGES_HUGETLB; return p; }
+    }
+#endif
+    // whole huge pages, so the tail of the block can be one too
+    size_t s = huge ? (*size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE : *size;
+#ifdef MADV_HUGEPAGE
+    if (huge) {
+        // THP only backs 2 MB aligned ranges: map one huge page more and trim the block to an aligned start
+        size_t over = s + HUGE_PAGE_SIZE;
+        char* m = mmap(NULL, over, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (m == MAP_FAILED) { return NULL; }
+        char* p = (char*)(((uintptr_t)m + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE);
+        if (p > m) { munmap(m, p - m); }
+        munmap(p + s, m + over - (p + s));
+        *size = s;
+        *backing = advise_huge(p, s);
+        return p;
+    }
+#endif
+    void* p = mmap(NULL, s, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) { return NULL; }
+    *size = s;
+    *backing = huge ? advise_huge(p, s) : PAGES_4K;
+    return p;
+}
+
+const char* page_backing_name(int backing) {
+    return backing == PAGES_HUGETLB ? "hugetlb pages" : backing == PAGES_THP ? "transparent huge pages" : "4 KB pages";
+}
+
+static long long huge_page_bytes(void* p, size_t size) {
+    // the bytes of [p, p + size) the kernel backs with huge pages right now, -1 if it can't be told.
+    // summed over the mappings in /proc/self/smaps that overlap the range, so at most size
+#ifdef __linux__
+    FILE* f = fopen("/proc/self/smaps", "r");
+    if (!f) { return -1; }
+    unsigned long long lo = (uintptr_t)p, hi = lo + size, total = 0;
+    int in = 0;
+    char line[256];
+    while (fgets(line, sizeof(line), f)) {
+        unsigned long long a, b, kb;
+        char key[32];
+        // a mapping is a line "start-end perms ...", followed by lines "Field: n kB" about it
+        if (sscanf(line, "%llx-%llx ", &a, &b) == 2) { in = a < hi && b > lo; continue; }
+        if (in && sscanf(line, "%31[^:]: %llu kB", key, &kb) == 2
+            && (!strcmp(key, "AnonHugePages") || !strcmp(key, "FilePmdMapped")
+                || !strcmp(key, "Private_Hugetlb") || !strcmp(key, "Shared_Hugetlb"))) {
+            total += kb * 1024;
+        }
+    }
+    fclose(f);
+    return total < size ? (long long)total : (long long)size;
+#else
+    (void)p;
+    (void)size;
+    return -1;
+#endif
+}
+
+static void print_pages(const char* what, void* p, size_t size, int backing) {
+    // the huge pages a block got, next to the ones asked for
+    long long huge = huge_page_bytes(p, size);
+    if (huge < 0) {
+        fprintf(stderr, "%s: %.1f MB, %s asked for\n", what, size / 1048576.0, page_backing_name(backing));
+    } else {
+        fprintf(stderr, "%s: %.1f MB, %.1f MB of it on huge pages, %s asked for\n", what, size / 1048576.0,
+                huge / 1048576.0, page_backing_name(backing));
+    }
+}
+
+static void* arena_take_bytes(char* base, size_t* off, size_t bytes) {
+    // the next bytes of an arena, WEIGHT_ALIGN aligned. with base NULL only the size is counted
+    void* p = base ? base + *off : NULL;
+    *off += (bytes + WEIGHT_ALIGN - 1) / WEIGHT_ALIGN * WEIGHT_ALIGN;
+    return p;
+}
+
+static float* arena_take(char* base, size_t* off, size_t n) {
+    return arena_take_bytes(base, off, n * sizeof(float));
+}
+
+static size_t kv_type_bytes(int type) {
+    return type == KV_Q8 ? sizeof(int8_t) : type == KV_FP16 ? sizeof(uint16_t) : sizeof(float);
+}
+
+static size_t kv_page_bytes(KVCache* c) {
+    return c->n_layers * c->layer_bytes;
+}
+
+static void lock_warning(int* failed) {
+    // once per *failed flag: the weights and run state at load, the kv pages as they come
+    if (!*failed) { fprintf(stderr, "mlock failed for some of the weights, run state or kv cache, check ulimit -l\n"); }
+    *failed = 1;
+}
+
+static char* kv_alloc_page(KVCache* c, int page) {
+    // the page holding timesteps [page * KV_PAGE, (page + 1) * KV_PAGE) to write to, on first use.
+    // the pages of a cache are slots of one slab on the pages -H asks for (see alloc_pages), mapped
+    // when the first one is needed. it is anonymous memory, so a slot takes memory once written to.
+    // a borrowed page is copied first, its owner and the other forks keep reading the original
+    int borrowed = c->borrowed && c->borrowed[page];
+    if (c->pages[page] && !borrowed) { return c->pages[page]; }
+    if (!c->slab) {
+        c->slab_size = c->n_pages * kv_page_bytes(c);
+        c->slab = alloc_pages(&c->slab_size, c->huge, &c->slab_backing);
+        if (!c->slab) { fprintf(stderr, "malloc failed!\n"); exit(EXIT_FAILURE); }
+    }
+    char* slot = c->slab + page * kv_page_bytes(c);
+    if (borrowed) {
+        memcpy(slot, c->pages[page], kv_page_bytes(c));
+        c->borrowed[page] = 0;
+    }
+    if (c->lock && mlock(slot, kv_page_bytes(c)) != 0) { lock_warning(&c->lock_failed); }
+    c->pages[page] = slot;
+    c->n_alloc++;
+    return slot;
+}
+
+static void kv_free_pages(KVCache* c) {
+    // back to an empty cache: the page table stays, the slab goes (and with it any lock on its pages).
+    // pages of a session map or of the cache a fork borrows from are not ours, they are only dropped
+    for (int i = 0; i < c->n_pages; i++) {
+        c->pages[i] = NULL;
+        if (c->borrowed) { c->borrowed[i] = 0; }
+    }
+    if (c->slab) { munmap(c->slab, c->slab_size); }
+    c->slab = NULL;
+    if (c->map) { munmap(c->map, c->map_size); }
+    c->map = NULL;
+    c->n_alloc = 0;
+}
+
+void malloc_kv_cache(KVCache* c, Config* p, int kv_type, int huge) {
+    // an empty page table, forward() allocates the pages as it reaches them
+    c->type = kv_type;
+    c->kv_dim = (p->dim * p->n_kv_heads) / p->n_heads;
+    c->head_size = p->dim / p->n_heads;
+    c->n_layers = p->n_layers;
+    c->seq_len = p->seq_len;
+    c->n_pages = (p->seq_len + KV_PAGE - 1) / KV_PAGE;
+    c->pages = calloc(c->n_pages, sizeof(char*));
+    if (!c->pages) { fprintf(stderr, "malloc failed!\n"); exit(EXIT_FAILURE); }
+    c->n_alloc = 0;
+    c->rows_bytes = (size_t)KV_PAGE * c->kv_dim * kv_type_bytes(kv_type);
+    size_t scales = kv_type == KV_Q8 ? 2 * (size_t)KV_PAGE * p->n_kv_heads * sizeof(float) : 0;
+    c->layer_bytes = (2 * c->rows_bytes + scales + WEIGHT_ALIGN - 1) / WEIGHT_ALIGN * WEIGHT_ALIGN;
+    c->lock = 0;
+    c->lock_failed = 0;
+    c->huge = huge;
+    c->slab = NULL;
+    c->n_sink = 0;
+    c->window = 0;
+    c->map = NULL;
+    c->borrowed = NULL;
+#if AD
+    // the gradient pass must not see allocations inside forward(), so all pages are there up front
+    for (int i = 0; i < c->n_pages; i++) { memset(kv_alloc_page(c, i), 0, kv_page_bytes(c)); }
+#endif
+}
+
+void free_kv_cache(KVCache* c) {
+    kv_free_pages(c);
+    free(c->pages);
+    free(c->borrowed);
+}
+
+void kv_fork(KVCache* c, KVCache* src) {
+    // c, an empty cache laid out like src, continues from src's timesteps without copying them: it
+    // borrows src's pages and copies one only when it writes to it (the page src's last position is
+    // in, or a ring slot when streaming). src must not be written to or freed while c borrows from it
+    kv_free_pages(c);
+    if (!c->borrowed) { c->borrowed = calloc(c->n_pages, 1); }
+    if (!c->borrowed) { fprintf(stderr, "malloc failed!\n"); exit(EXIT_FAILURE); }
+    for (int i = 0; i < c->n_pages; i++) {
+        c->pages[i] = src->pages[i];
+        c->borrowed[i] = src->pages[i] != NULL;
+    }
+}
+
+void malloc_run_state(RunState* s, Config* p, int huge, int kv_type) {
+    // every buffer but the kv cache comes from one zeroed arena, on huge pages if asked for (see
+    // alloc_pages). the kv cache is paged, so a session only holds the pages it has reached
+    size_t kv_dim = (p->dim * p->n_kv_heads) / p->n_heads;
+    size_t seq_len = p->seq_len;
+    malloc_kv_cache(&s->kv, p, kv_type, huge);
+    char* base = NULL;
+    size_t size = 0;
+    for (int pass = 0; pass < 2; pass++) {
+        // the first pass sizes the arena, the second one hands it out
+        size_t off = 0;
+        s->x = arena_take(base, &off, p->dim);
+        s->xb = arena_take(base, &off, p->dim);
+        s->xb2 = arena_take(base, &off, p->dim);
+        s->hb = arena_take(base, &off, p->hidden_dim);
+        s->hb2 = arena_take(base, &off, p->hidden_dim);
+        // q, k and v are one contiguous block so the fused qkv matmul can write all three at once
+        s->q = arena_take(base, &off, p->dim + 2 * kv_dim);
+        s->att = arena_take(base, &off, p->n_heads * seq_len);
+        s->logits = arena_take(base, &off, p->vocab_size);
+        s->rope = arena_take(base, &off, seq_len * (p->dim / p->n_heads));
+        s->px = arena_take(base, &off, PREFILL_BATCH * p->dim);
+        s->pxb = arena_take(base, &off, PREFILL_BATCH * p->dim);
+        s->pxb2 = arena_take(base, &off, PREFILL_BATCH * p->dim);
+        s->pqkv = arena_take(base, &off, PREFILL_BATCH * (p->dim + 2 * kv_dim));
+        s->phb = arena_take(base, &off, PREFILL_BATCH * p->hidden_dim);
+        s->phb2 = arena_take(base, &off, PREFILL_BATCH * p->hidden_dim);
+        if (pass == 0) {
+            size = off;
+            base = alloc_pages(&size, huge, &s->arena_backing);
+            if (!base) { fprintf(stderr, "malloc failed!\n"); exit(EXIT_FAILURE); }
+        }
+    }
+    s->k = s->q + p->dim;
+    s->v = s->k + kv_dim;
+    s->arena = base;
+    s->arena_size = size;
+}
+
+void init_rope(float* rope, Config* p, int trained_len, int scaling) {
+    // cos/sin table for RoPE: rope[pos * head_size + i] and [.. + i + 1] rotate the pair (i, i+1) of
+    // every head at pos. a seq_len above the trained context is reached by scaling the rotation:
+    // linear divides the positions by the extension factor (position interpolation), NTK-aware
+    // raises the base instead, which stretches the low frequencies and keeps the high ones
+    int head_size = p->dim / p->n_heads;
+    float scale = p->seq_len > trained_len ? (float)p->seq_len / trained_len : 1.0f;
+    float base = 10000.0f;
+    if (scaling == ROPE_NTK) { base *= powf(scale, head_size / (head_size - 2.0f)); }
+    for (int pos = 0; pos < p->seq_len; pos++) {
+        for (int i = 0; i < head_size; i += 2) {
+            float freq = 1.0f / powf(base, i / (float)head_size);
+            float val = pos * freq;
+            if (scaling == ROPE_LINEAR) { val /= scale; }
+            rope[pos * head_size + i] = cosf(val);
+            rope[pos * head_size + i + 1] = sinf(val);
+        }
     }
 }
 
 void zero_run_state(RunState* s, Config* p) {
     // we calloc instead of malloc to keep valgrind happy
+    int kv_dim = (p->dim * p->n_kv_heads) / p->n_heads;
     memset(s->x, 0, p->dim * sizeof(float));
     memset(s->xb, 0, p->dim * sizeof(float));
     memset(s->xb2, 0, p->dim * sizeof(float));
     memset(s->hb, 0,p->hidden_dim * sizeof(float));
     memset(s->hb2, 0,p->hidden_dim * sizeof(float));
-    memset(s->q, 0,p->dim * sizeof(float));
-    memset(s->k, 0,p->dim * sizeof(float));
-    memset(s->v, 0,p->dim * sizeof(float));
+    memset(s->q, 0,(p->dim + 2 * kv_dim) * sizeof(float)); // q, k and v
     memset(s->att, 0,p->n_heads * p->seq_len * sizeof(float));
     memset(s->logits, 0,p->vocab_size * sizeof(float));
-    memset(s->key_cache, 0,p->n_layers * p->seq_len * p->dim * sizeof(float));
-    memset(s->value_cache, 0,p->n_layers * p->seq_len * p->dim * sizeof(float));
+    // s->rope is a constant table, not state
+#if AD
+    for (int i = 0; i < s->kv.n_pages; i++) { memset(s->kv.pages[i], 0, kv_page_bytes(&s->kv)); }
+#else
+    kv_free_pages(&s->kv);
+#endif
 }
 
 void free_run_state(RunState* s) {
-    free(s->x);
-    free(s->xb);
-    free(s->xb2);
-    free(s->hb);
-    free(s->hb2);
-    free(s->q);
-    free(s->k);
-    free(s->v);
-    free(s->att);
-    free(s->logits);
-    free(s->key_cache);
-    free(s->value_cache);
-}
-
-void memory_map_weights(TransformerWeights *w, Config* p, float* ptr, int shared_weights) {
+    free_kv_cache(&s->kv);
+    munmap(s->arena, s->arena_size);
+}
+
+size_t values_bytes(int type, size_t n) {
+    // size of n weight values of the given type, not counting the scales
+    if (type == WT_Q4_0) { return n / 2; }
+    if (type == WT_F16 || type == WT_BF16) { return n * sizeof(uint16_t); }
+    return n * (type == WT_Q8_0 ? sizeof(int8_t) : sizeof(float));
+}
+
+size_t tensor_bytes(QuantizedTensor* t) {
+    return values_bytes(t->type, t->n);
+}
+
+void unpanel_rows(char* dst, QuantizedTensor* t, int n, int start, int end) {
+    // copy the rows [start, end) of a repacked t (rows of n values) out row-major, see repack_weights()
+    size_t rb = values_bytes(t->type, n), d = t->n / n;
+    for (int i = start; i < end; i++) {
+        size_t p0 = i - i % PANEL_ROWS; // first row of the panel
+        size_t rc = d - p0 < PANEL_ROWS ? d - p0 : PANEL_ROWS; // rows in the panel
+        char* panel = (char*)t->q + p0 * rb;
+        for (size_t c = 0; c < rb / PANEL_BYTES; c++) {
+            memcpy(dst + c * PANEL_BYTES, panel + (c * rc + i % PANEL_ROWS) * PANEL_BYTES, PANEL_BYTES);
+        }
+        dst += rb;
+    }
+}
+
+QuantizedTensor* init_tensors(void** ptr, int n, size_t size_each, int type, int gs) {
+    // map n consecutive tensors of size_each values each, advancing *ptr past them.
+    // for quantized types only the values are mapped here, scales are set by init_scales
+    QuantizedTensor* res = malloc(n * sizeof(QuantizedTensor));
+    if (!res) { fprintf(stderr, "malloc failed!\n"); exit(EXIT_FAILURE); }
+    char* p = *ptr;
+    for (int i = 0; i < n; i++) {
+        res[i].q = p;
+        res[i].s = NULL;
+        res[i].type = type;
+        res[i].gs = gs;
+        res[i].n = size_each;
+        res[i].panel = 0;
+        p += tensor_bytes(&res[i]);
+    }
+    *ptr = p;
+    return res;
+}
+
+void init_scales(float** ptr, QuantizedTensor* t, int n, size_t size_each) {
+    // export.py writes all scaling factors after all the quantized values, in the same order
+    for (int i = 0; i < n; i++) {
+        t[i].s = *ptr;
+        *ptr += size_each / t[i].gs;
+    }
+}
+
+void memory_map_weights(TransformerWeights *w, Config* p, void* ptr, int shared_weights) {
+    // v0 legacy layout
     int head_size = p->dim / p->n_heads;
     // make sure the multiplications below are done in 64bit to fit the parameter counts of 13B+ models
     unsigned long long n_layers = p->n_layers;
-    w->token_embedding_table = ptr;
-    ptr += p->vocab_size * p->dim;
+    size_t dim = p->dim, kv_dim = p->n_kv_heads * head_size, hidden_dim = p->hidden_dim;
+    w->token_embedding_table = init_tensors(&ptr, 1, p->vocab_size * dim, WT_FP32, 0);
     w->rms_att_weight = ptr;
-    ptr += n_layers * p->dim;
-    w->wq = ptr;
-    ptr += n_layers * p->dim * (p->n_heads * head_size);
-    w->wk = ptr;
-    ptr += n_layers * p->dim * (p->n_kv_heads * head_size);
-    w->wv = ptr;
-    ptr += n_layers * p->dim * (p->n_kv_heads * head_size);
-    w->wo = ptr;
-    ptr += n_layers * (p->n_heads * head_size) * p->dim;
+    ptr = (float*)ptr + n_layers * dim;
+    w->wq = init_tensors(&ptr, n_layers, dim * dim, WT_FP32, 0);
+    w->wk = init_tensors(&ptr, n_layers, dim * kv_dim, WT_FP32, 0);
+    w->wv = init_tensors(&ptr, n_layers, dim * kv_dim, WT_FP32, 0);
+    w->wo = init_tensors(&ptr, n_layers, dim * dim, WT_FP32, 0);
     w->rms_ffn_weight = ptr;
-    ptr += n_layers * p->dim;
-    w->w1 = ptr;
-    ptr += n_layers * p->dim * p->hidden_dim;
-    w->w2 = ptr;
-    ptr += n_layers * p->hidden_dim * p->dim;
-    w->w3 = ptr;
-    ptr += n_layers * p->dim * p->hidden_dim;
+    ptr = (float*)ptr + n_layers * dim;
+    w->w1 = init_tensors(&ptr, n_layers, dim * hidden_dim, WT_FP32, 0);
+    w->w2 = init_tensors(&ptr, n_layers, hidden_dim * dim, WT_FP32, 0);
+    w->w3 = init_tensors(&ptr, n_layers, dim * hidden_dim, WT_FP32, 0);
     w->rms_final_weight = ptr;
-    ptr += p->dim;
-    ptr += p->seq_len * head_size / 2; // skip what used to be freq_cis_real (for RoPE)
-    ptr += p->seq_len * head_size / 2; // skip what used to be freq_cis_imag (for RoPE)
-    w->wcls = shared_weights ? w->token_embedding_table : ptr;
+    ptr = (float*)ptr + dim;
+    ptr = (float*)ptr + p->seq_len * head_size / 2; // skip what used to be freq_cis_real (for RoPE)
+    ptr = (float*)ptr + p->seq_len * head_size / 2; // skip what used to be freq_cis_imag (for RoPE)
+    w->wcls = shared_weights ? w->token_embedding_table : init_tensors(&ptr, 1, p->vocab_size * dim, WT_FP32, 0);
+}
+
+void memory_map_weights_v1(TransformerWeights *w, Config* p, void* ptr, int shared_weights, int type, int gs) {
+    // v1+ layout: the fp32 rmsnorm weights come first, then all the matmul weights
+    int head_size = p->dim / p->n_heads;
+    unsigned long long n_layers = p->n_layers;
+    size_t dim = p->dim, kv_dim = p->n_kv_heads * head_size, hidden_dim = p->hidden_dim;
+    float* fptr = ptr;
+    w->rms_att_weight = fptr;
+    fptr += n_layers * dim;
+    w->rms_ffn_weight = fptr;
+    fptr += n_layers * dim;
+    w->rms_final_weight = fptr;
+    fptr += dim;
+    ptr = fptr;
+    w->token_embedding_table = init_tensors(&ptr, 1, p->vocab_size * dim, type, gs);
+    w->wq = init_tensors(&ptr, n_layers, dim * dim, type, gs);
+    w->wk = init_tensors(&ptr, n_layers, dim * kv_dim, type, gs);
+    w->wv = init_tensors(&ptr, n_layers, dim * kv_dim, type, gs);
+    w->wo = init_tensors(&ptr, n_layers, dim * dim, type, gs);
+    w->w1 = init_tensors(&ptr, n_layers, dim * hidden_dim, type, gs);
+    w->w2 = init_tensors(&ptr, n_layers, hidden_dim * dim, type, gs);
+    w->w3 = init_tensors(&ptr, n_layers, dim * hidden_dim, type, gs);
+    w->wcls = shared_weights ? w->token_embedding_table : init_tensors(&ptr, 1, p->vocab_size * dim, type, gs);
+    if (!is_quantized(type)) { return; }
+    fptr = ptr;
+    init_scales(&fptr, w->token_embedding_table, 1, p->vocab_size * dim);
+    init_scales(&fptr, w->wq, n_layers, dim * dim);
+    init_scales(&fptr, w->wk, n_layers, dim * kv_dim);
+    init_scales(&fptr, w->wv, n_layers, dim * kv_dim);
+    init_scales(&fptr, w->wo, n_layers, dim * dim);
+    init_scales(&fptr, w->w1, n_layers, dim * hidden_dim);
+    init_scales(&fptr, w->w2, n_layers, hidden_dim * dim);
+    init_scales(&fptr, w->w3, n_layers, dim * hidden_dim);
+    if (!shared_weights) { init_scales(&fptr, w->wcls, 1, p->vocab_size * dim); }
+}
+
+typedef struct {
+    void** ptr;   // where the pointer to this region is stored
+    size_t bytes; // size of the region
+    QuantizedTensor* t; // the tensor when these are its values, NULL for scales and rmsnorm weights
+} WeightRegion;
+
+static int tensor_regions(QuantizedTensor* t, int n, WeightRegion* r) {
+    for (int i = 0; i < n; i++) {
+        if (r) { r[2*i].ptr = &t[i].q; r[2*i].bytes = tensor_bytes(&t[i]); r[2*i].t = &t[i]; }
+        if (r) {
+            r[2*i+1].ptr = (void**)&t[i].s;
+            r[2*i+1].bytes = is_quantized(t[i].type) ? t[i].n / t[i].gs * sizeof(float) : 0;
+            r[2*i+1].t = NULL;
+        }
+    }
+    return 2 * n;
+}
+
+int weight_regions(TransformerWeights* w, Config* p, WeightRegion* r) {
+    // lists every weight array (values and scales) into r, or just counts them if r is NULL.
+    // the order is the one forward() first touches them in
+    int n = 0;
+    n += tensor_regions(w->token_embedding_table, 1, r ? r + n : NULL);
+    if (r) { r[n].ptr = (void**)&w->rms_att_weight; r[n].bytes = (size_t)p->n_layers * p->dim * sizeof(float); r[n].t = NULL; }
+    n++;
+    if (r) { r[n].ptr = (void**)&w->rms_ffn_weight; r[n].bytes = (size_t)p->n_layers * p->dim * sizeof(float); r[n].t = NULL; }
+    n++;
+    for (int l = 0; l < p->n_layers; l++) {
+        if (w->wqkv) {
+            n += tensor_regions(w->wqkv + l, 1, r ? r + n : NULL);
+        } else {
+            n += tensor_regions(w->wq + l, 1, r ? r + n : NULL);
+            n += tensor_regions(w->wk + l, 1, r ? r + n : NULL);
+            n += tensor_regions(w->wv + l, 1, r ? r + n : NULL);
+        }
+        n += tensor_regions(w->wo + l, 1, r ? r + n : NULL);
+        n += tensor_regions(w->w1 + l, 1, r ? r + n : NULL);
+        n += tensor_regions(w->w3 + l, 1, r ? r + n : NULL);
+        n += tensor_regions(w->w2 + l, 1, r ? r + n : NULL);
+    }
+    if (r) { r[n].ptr = (void**)&w->rms_final_weight; r[n].bytes = (size_t)p->dim * sizeof(float); r[n].t = NULL; }
+    n++;
+    if (w->wcls != w->token_embedding_table) { n += tensor_regions(w->wcls, 1, r ? r + n : NULL); }
+    return n;
+}
+
+static int tensor_cols(TransformerWeights* w, Config* p, QuantizedTensor* t) {
+    // values per row of a weight matrix, w2 is the only one with rows of hidden_dim values
+    return t >= w->w2 && t < w->w2 + p->n_layers ? p->hidden_dim : p->dim;
+}
+
+void align_weights(TransformerWeights* w, Config* p) {
+    // headered checkpoints keep every tensor WEIGHT_ALIGN aligned as long as the model dims are
+    // multiples of 16, so the weights are used in place. odd shapes (or an embedded checkpoint
+    // that the linker placed at an odd address) get copied once into an aligned buffer instead
+    int n = weight_regions(w, p, NULL);
+    WeightRegion* r = malloc(n * sizeof(WeightRegion));
+    if (!r) { fprintf(stderr, "malloc failed!\n"); exit(EXIT_FAILURE); }
+    weight_regions(w, p, r);
+    size_t total = 0;
+    int misaligned = 0;
+    for (int i = 0; i < n; i++) {
+        if (r[i].bytes == 0) { continue; }
+        if ((uintptr_t)*r[i].ptr % WEIGHT_ALIGN != 0) { misaligned = 1; }
+        total += (r[i].bytes + WEIGHT_ALIGN - 1) / WEIGHT_ALIGN * WEIGHT_ALIGN;
+    }
+    if (misaligned) {
+        char* copy = aligned_alloc(WEIGHT_ALIGN, total);
+        if (!copy) { fprintf(stderr, "malloc failed!\n"); exit(EXIT_FAILURE); }
+        char* dst = copy;
+        for (int i = 0; i < n; i++) {
+            if (r[i].bytes == 0) { continue; }
+            memcpy(dst, *r[i].ptr, r[i].bytes);
+            *r[i].ptr = dst;
+            dst += (r[i].bytes + WEIGHT_ALIGN - 1) / WEIGHT_ALIGN * WEIGHT_ALIGN;
+        }
+        w->aligned_copy = copy;
+    }
+    free(r);
+}
+
+void fuse_qkv(TransformerWeights* w, Config* p, int copy) {
+    // stack the rows of each layer's wq, wk and wv into one (dim + 2*kv_dim, dim) matrix.
+    // q, k and v are contiguous in RunState, so a single matmul then streams xb once and
+    // writes all three, instead of three matmuls (and three parallel regions) per layer.
+    // without copy only the wqkv tensors are set up, for a repack cache to fill in
+    size_t dim = p->dim, kv_dim = (p->dim * p->n_kv_heads) / p->n_heads;
+    QuantizedTensor proto = { .type = w->wq->type, .gs = w->wq->gs, .n = (dim + 2 * kv_dim) * dim };
+    size_t bytes = tensor_bytes(&proto);
+    size_t n_scales = is_quantized(proto.type) ? proto.n / proto.gs : 0;
+    size_t total = (p->n_layers * bytes + WEIGHT_ALIGN - 1) / WEIGHT_ALIGN * WEIGHT_ALIGN;
+    size_t total_s = (p->n_layers * n_scales * sizeof(float) + WEIGHT_ALIGN - 1) / WEIGHT_ALIGN * WEIGHT_ALIGN;
+    QuantizedTensor* t = malloc(p->n_layers * sizeof(QuantizedTensor));
+    if (!t) { fprintf(stderr, "malloc failed!\n"); exit(EXIT_FAILURE); }
+    w->wqkv = t;
+    if (!copy) {
+        for (int l = 0; l < p->n_layers; l++) { t[l] = proto; }
+        return;
+    }
+    char* q = aligned_alloc(WEIGHT_ALIGN, total);
+    float* s = n_scales ? aligned_alloc(WEIGHT_ALIGN, total_s) : NULL;
+    if (!q || (n_scales && !s)) { fprintf(stderr, "malloc failed!\n"); exit(EXIT_FAILURE); }
+    w->qkv_copy = q;
+    w->qkv_scales = s;
+    for (int l = 0; l < p->n_layers; l++) {
+        QuantizedTensor* parts[3] = { w->wq + l, w->wk + l, w->wv + l };
+        t[l] = proto;
+        t[l].q = q + l * bytes;
+        t[l].s = s ? s + l * n_scales : NULL;
+        char* dq = t[l].q;
+        float* ds = t[l].s;
+        for (int i = 0; i < 3; i++) {
+            memcpy(dq, parts[i]->q, tensor_bytes(parts[i]));
+            dq += tensor_bytes(parts[i]);
+            if (ds) {
+                memcpy(ds, parts[i]->s, parts[i]->n / parts[i]->gs * sizeof(float));
+                ds += parts[i]->n / parts[i]->gs;
+            }
+        }
+    }
+}
+
+void copy_weights(TransformerWeights* w, Config* p, int huge, void (*copy_tensor)(QuantizedTensor*, char*, float*, int)) {
+    // move all the weights into one block of fresh anonymous memory on the pages asked for (see
+    // alloc_pages). copy_tensor, if given, copies the values and scales of every matrix instead
+    // of a memcpy, e.g. to place them (see numa_spread_weights)
+    int n = weight_regions(w, p, NULL);
+    WeightRegion* r = malloc(n * sizeof(WeightRegion));
+    if (!r) { fprintf(stderr, "malloc failed!\n"); exit(EXIT_FAILURE); }
+    weight_regions(w, p, r);
+    size_t total = 0;
+    for (int i = 0; i < n; i++) { total += (r[i].bytes + WEIGHT_ALIGN - 1) / WEIGHT_ALIGN * WEIGHT_ALIGN; }
+    int backing;
+    char* image = alloc_pages(&total, huge, &backing);
+    if (!image) { fprintf(stderr, "mmap failed, the weights stay where they are\n"); free(r); return; }
+    char* dst = image;
+    for (int i = 0; i < n; i++) {
+        if (r[i].bytes == 0) { continue; }
+        QuantizedTensor* t = copy_tensor ? r[i].t : NULL;
+        if (!t) {
+            memcpy(dst, *r[i].ptr, r[i].bytes);
+            *r[i].ptr = dst;
+            dst += (r[i].bytes + WEIGHT_ALIGN - 1) / WEIGHT_ALIGN * WEIGHT_ALIGN;
+            continue;
+        }
+        // the values, and their scales which are the next region
+        char* dst_s = dst + (r[i].bytes + WEIGHT_ALIGN - 1) / WEIGHT_ALIGN * WEIGHT_ALIGN;
+        copy_tensor(t, dst, (float*)dst_s, tensor_cols(w, p, t));
+        t->q = dst;
+        if (is_quantized(t->type)) { t->s = (float*)dst_s; }
+        dst = dst_s + (r[i + 1].bytes + WEIGHT_ALIGN - 1) / WEIGHT_ALIGN * WEIGHT_ALIGN;
+        i++;
+    }
+    // everything lives in the copy now
+    free(w->aligned_copy);
+    free(w->qkv_copy);
+    free(w->qkv_scales);
+    free(w->panel_copy);
+    if (w->panel_map) { munmap(w->panel_map, w->panel_map_size); }
+    if (w->anon_copy) { munmap(w->anon_copy, w->anon_copy_size); }
+    w->aligned_copy = w->qkv_copy = w->qkv_scales = w->panel_copy = w->panel_map = NULL;
+    w->anon_copy = image;
+    w->anon_copy_size = total;
+    w->anon_backing = backing;
+    free(r);
+}
+
+static void page_span(void* p, size_t bytes, char** start, size_t* len) {
+    // the whole pages covering [p, p + bytes), what madvise and mlock take
+#ifdef _SC_PAGESIZE
+    uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+#else
+    uintptr_t page = 4096;
+#endif
+    uintptr_t a = (uintptr_t)p / page * page;
+    *start = (char*)a;
+    *len = (uintptr_t)p + bytes - a;
+}
+
+int lock_weights(TransformerWeights* w, Config* p, int lock) {
+    // mlock (or with lock 0, munlock) every weight array, so generation never waits on a page fault.
+    // returns 0 if some could not be locked, usually for want of RLIMIT_MEMLOCK (ulimit -l)
+    int n = weight_regions(w, p, NULL), ok = 1;
+    WeightRegion* r = malloc(n * sizeof(WeightRegion));
+    if (!r) { fprintf(stderr, "malloc failed!\n"); exit(EXIT_FAILURE); }
+    weight_regions(w, p, r);
+    for (int i = 0; i < n; i++) {
+        if (r[i].bytes == 0) { continue; }
+        char* start;
+        size_t len;
+        page_span(*r[i].ptr, r[i].bytes, &start, &len);
+        if (lock) { ok &= mlock(start, len) == 0; } else { munlock(start, len); }
+    }
+    free(r);
+    return ok;
+}
+
+// defined with the matmul kernels, the touching is a parallel loop
+void warmup_weights(TransformerWeights* w, Config* p, int mode);
+
+// defined with the matmul kernels, which decide what can be repacked
+void repack_weights(TransformerWeights* w, Config* p, int version, int fuse, int fd, char* cache_path, int stats);
+#ifdef NUMA
+// defined with the thread pool, whose threads place the copy
+void numa_spread_weights(TransformerWeights* w, Config* p, int huge);
+#endif
+
+void free_weights(TransformerWeights *w) {
+    free(w->aligned_copy);
+    free(w->qkv_copy);
+    free(w->qkv_scales);
+    free(w->panel_copy);
+    if (w->panel_map) { munmap(w->panel_map, w->panel_map_size); }
+    if (w->anon_copy) { munmap(w->anon_copy, w->anon_copy_size); }
+    free(w->wqkv);
+    if (w->wcls != w->token_embedding_table) { free(w->wcls); }
+    free(w->token_embedding_table);
+    free(w->wq);
+    free(w->wk);
+    free(w->wv);
+    free(w->wo);
+    free(w->w1);
+    free(w->w2);
+    free(w->w3);
 }
 
+int parse_checkpoint(char* checkpoint, Config* config, TransformerWeights* weights, int* version) {
+    // read the header and memory map the weights of an in-memory checkpoint image.
+    // returns the offset of the weights from the start of the image, in bytes
+    int header_size, shared_weights, type = WT_FP32, gs = 0;
+    uint32_t magic;
+    memcpy(&magic, checkpoint, sizeof(uint32_t));
+    if (magic != CHECKPOINT_MAGIC) {
+        // legacy v0: the file starts directly with the Config
+        memcpy(config, checkpoint, sizeof(Config));
+        // negative vocab size is hacky way of signaling unshared weights. bit yikes.
+        shared_weights = config->vocab_size > 0 ? 1 : 0;
+        config->vocab_size = abs(config->vocab_size);
+        *version = 0;
+        header_size = sizeof(Config);
+    } else {
+        // magic (uint32), version (int), Config (7 ints), shared classifier (uint8), [group size (int)]
+        memcpy(version, checkpoint + 4, sizeof(int));
+        memcpy(config, checkpoint + 8, sizeof(Config));
+        shared_weights = (unsigned char)checkpoint[8 + sizeof(Config)];
+        if (*version == 2 || *version == 3) {
+            memcpy(&gs, checkpoint + 8 + sizeof(Config) + 1, sizeof(int));
+            type = *version == 2 ? WT_Q8_0 : WT_Q4_0;
+        } else if (*version == 4 || *version == 5) {
+            type = *version == 4 ? WT_F16 : WT_BF16;
+        } else if (*version != 1) {
+            fprintf(stderr, "unsupported checkpoint version %d\n", *version); exit(EXIT_FAILURE);
+        }
+        header_size = CHECKPOINT_HEADER_SIZE;
+    }
+    if (is_quantized(type) && (gs <= 0 || config->dim % gs != 0 || config->hidden_dim % gs != 0
+                            || (type == WT_Q4_0 && gs % Q4_BLOCK != 0))) {
+        fprintf(stderr, "bad quantization group size %d\n", gs); exit(EXIT_FAILURE);
+    }
+    weights->aligned_copy = NULL;
+    weights->qkv_copy = NULL;
+    weights->qkv_scales = NULL;
+    weights->panel_copy = NULL;
+    weights->panel_map = NULL;
+    weights->anon_copy = NULL;
+    weights->wqkv = NULL;
+    if (*version == 0) {
+        // v0 tensors start at the odd 28 byte offset, kept as is for compatibility
+        memory_map_weights(weights, config, checkpoint + header_size, shared_weights);
+    } else {
+        memory_map_weights_v1(weights, config, checkpoint + header_size, shared_weights, type, gs);
+#if !AD
+        // training updates the mapped weights in place, so it has to keep using the mapping
+        align_weights(weights, config);
+#endif
+    }
+    return header_size;
+}
 
 #if defined (INC_BIN) || defined(STRLIT)
-void read_checkpoint(char* checkpoint, Config* config, TransformerWeights* weights, 
-                     int* fd, float** data, ssize_t* file_size) {
-    // read config header directly from the checkpoint data
-    memcpy(config, checkpoint, sizeof(Config));
-    int shared_weights = config->vocab_size > 0 ? 1 : 0;
-    config->vocab_size = abs(config->vocab_size);
+void read_checkpoint(char* checkpoint, Config* config, TransformerWeights* weights, TransformerWeights* dweights,
+		     float** weights_ptr, float** const dweights_ptr, int* version,
+                     int* fd, float** data, float** ddata, ssize_t* file_size, ssize_t* dfile_size) {
+    // the checkpoint is embedded in the executable, use it in place
     *file_size = strlen(checkpoint); // get the data size, in bytes
-    // memory map the Transformer weights
-    *data = (float*)(checkpoint + sizeof(Config));    
-    float* weights_ptr = *data;
+    *data = (float*)checkpoint;
+    *ddata = MAP_FAILED;
     *fd = -1;
-    memory_map_weights(weights, config, weights_ptr, shared_weights);
+    int header_size = parse_checkpoint(checkpoint, config, weights, version);
+    *weights_ptr = (float*)(checkpoint + header_size);
 }
 #else
 void read_checkpoint(char* checkpoint, Config* config, TransformerWeights* weights, TransformerWeights* dweights,
-		     float** weights_ptr, float** const dweights_ptr,
+		     float** weights_ptr, float** const dweights_ptr, int* version,
                      int* fd, float** data, float** ddata, ssize_t* file_size, ssize_t* dfile_size) {
     FILE *file = fopen(checkpoint, "rb");
     if (!file) { fprintf(stderr, "Couldn't open file %s\n", checkpoint); exit(EXIT_FAILURE); }
-    // read in the config header
-    if (fread(config, sizeof(Config), 1, file) != 1) { exit(EXIT_FAILURE); }
-    // negative vocab size is hacky way of signaling unshared weights. bit yikes.
-    int shared_weights = config->vocab_size > 0 ? 1 : 0;
-    config->vocab_size = abs(config->vocab_size);
     // figure out the file size
     fseek(file, 0, SEEK_END); // move file pointer to end of file
     *file_size = ftell(file); // get the file size, in bytes
     fclose(file);
+    if (*file_size < CHECKPOINT_HEADER_SIZE) { fprintf(stderr, "%s is too small to be a checkpoint\n", checkpoint); exit(EXIT_FAILURE); }
     // memory map the Transformer weights into the data pointer
     *fd = open(checkpoint, O_RDONLY); // open in read only mode
     if (*fd == -1) { fprintf(stderr, "open failed!\n"); exit(EXIT_FAILURE); }
+#if AD
+    // training updates the weights in place, in a private copy-on-write mapping
     *data = mmap(NULL, *file_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, *fd, 0);
+#else
+    // inference never writes the weights: a read-only shared mapping, so every process running
+    // this checkpoint uses the same page cache copy, and a stray write faults instead of copying
+    *data = mmap(NULL, *file_size, PROT_READ, MAP_SHARED, *fd, 0);
+#endif
     if (*data == MAP_FAILED) { fprintf(stderr, "mmap data failed!\n"); exit(EXIT_FAILURE); }
-    *weights_ptr = *data + sizeof(Config)/sizeof(float);
-    memory_map_weights(weights, config, *weights_ptr, shared_weights);
+    *ddata = MAP_FAILED;
+    int header_size = parse_checkpoint((char*)*data, config, weights, version);
+    *weights_ptr = (float*)((char*)*data + header_size);
 #if AD
+    if (*version >= 2) { fprintf(stderr, "training needs an fp32 checkpoint\n"); exit(EXIT_FAILURE); }
     *ddata = mmap(NULL, *file_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
     if (*ddata == MAP_FAILED) { printf("mmap ddata failed!\n"); exit(EXIT_FAILURE); }
     memset(*ddata, 0, *file_size);
-    *dweights_ptr = *ddata + sizeof(Config)/sizeof(float);    
-    memory_map_weights(dweights, config, *dweights_ptr, shared_weights);
+    *dweights_ptr = (float*)((char*)*ddata + header_size);
+    Config dconfig;
+    memcpy(*ddata, *data, header_size); // the shadow needs the same header to map identically
+    parse_checkpoint((char*)*ddata, &dconfig, dweights, version);
 #endif
 }
 #endif
 
 void build_transformer(Transformer *t, char* checkpoint_path) {
     // read in the Config and the Weights from the checkpoint
-    read_checkpoint(checkpoint_path, &t->config, &t->weights, &t->dweights, &t->weights_ptr, &t->dweights_ptr, &t->fd, &t->data, &t->ddata, &t->file_size, &t->dfile_size);
+    read_checkpoint(checkpoint_path, &t->config, &t->weights, &t->dweights, &t->weights_ptr, &t->dweights_ptr, &t->version, &t->fd, &t->data, &t->ddata, &t->file_size, &t->dfile_size);
+#if !AD
+    // a file mapping gets transparent huge pages only where the kernel supports them for its
+    // filesystem (e.g. CONFIG_READ_ONLY_THP_FOR_FS), otherwise the advice is a no-op
+    t->map_backing = t->huge && t->fd != -1 ? advise_huge(t->data, t->file_size) : PAGES_4K;
+    // repacks leave the mapped weights untouched, training needs them to stay the ones it updates
+    if (t->repack) {
+        // panels for the SIMD kernels, kept in a cache file next to the checkpoint
+        char cache_path[strlen(checkpoint_path) + 8];
+        sprintf(cache_path, "%s.panels", checkpoint_path);
+        repack_weights(&t->weights, &t->config, t->version, t->fuse_qkv, t->fd, t->fd != -1 ? cache_path : NULL, t->stats);
+    } else if (t->fuse_qkv) {
+        fuse_qkv(&t->weights, &t->config, 1);
+    }
+#ifdef NUMA
+    if (t->numa) { numa_spread_weights(&t->weights, &t->config, t->huge); }
+#endif
+    // explicit huge pages for the weights mean a copy, the checkpoint is mapped from a regular file
+    if (t->huge == PAGES_HUGETLB && !t->weights.anon_copy) { copy_weights(&t->weights, &t->config, t->huge, NULL); }
+#endif
+    // the kv cache and rope table are sized by the context length we run with
+    int trained_len = t->config.seq_len;
+    if (t->seq_len > 0) { t->config.seq_len = t->seq_len; }
     // allocate the RunState buffers
-    malloc_run_state(&t->state, &t->config);
+#if AD
+    t->kv_type = KV_FP32; // the gradient flows through fp32 only
+#endif
+    malloc_run_state(&t->state, &t->config, t->huge, t->kv_type);
+#if !AD
+    if (t->sinks > 0) {
+        // the rest of the cache is the window, at least one slot of it
+        t->state.kv.n_sink = t->sinks < t->config.seq_len ? t->sinks : t->config.seq_len - 1;
+        t->state.kv.window = t->config.seq_len - t->state.kv.n_sink;
+    }
+#endif
+    init_rope(t->state.rope, &t->config, trained_len, t->rope_scaling);
     // new, Manuel
 #if AD
-    malloc_run_state(&t->dstate, &t->config);
+    malloc_run_state(&t->dstate, &t->config, t->huge, t->kv_type);
 #endif
+    // page the weights in now, in the order forward() reads them, instead of faulting in the first tokens
+    if (t->warmup) { warmup_weights(&t->weights, &t->config, t->warmup); }
+    if (t->mlock) {
+        int ok = lock_weights(&t->weights, &t->config, 1);
+        ok &= mlock(t->state.arena, t->state.arena_size) == 0;
+        t->state.kv.lock = 1; // the kv pages are locked as they come
+        if (!ok) { lock_warning(&t->state.kv.lock_failed); }
+    }
 }
 
 void free_transformer(Transformer* t) {
-    // close the memory mapping
-    if (t->data != MAP_FAILED) { munmap(t->data, t->file_size); }
-    if (t->ddata != MAP_FAILED) { munmap(t->ddata, t->file_size); }
+    // heap copies of the weights would stay locked once freed
+    if (t->mlock) { lock_weights(&t->weights, &t->config, 0); }
+    free_weights(&t->weights);
+    // close the memory mapping, embedded checkpoints (fd == -1) are not ours to unmap
+    if (t->fd != -1 && t->data != MAP_FAILED) { munmap(t->data, t->file_size); }
+    if (t->ddata != MAP_FAILED) { free_weights(&t->dweights); munmap(t->ddata, t->file_size); }
     if (t->fd != -1) { close(t->fd); }
     // free the RunState buffers
     free_run_state(&t->state);
@@ -362,6 +1154,151 @@ void free_transformer(Transformer* t) {
 #endif
 }
 
+void report_pages(Transformer* t) {
+    // the huge pages the run state, kv cache and weights ended up on, once generation has touched them
+    print_pages("run state", t->state.arena, t->state.arena_size, t->state.arena_backing);
+    KVCache* c = &t->state.kv;
+    if (c->slab) { print_pages("kv cache slab", c->slab, c->slab_size, c->slab_backing); }
+    TransformerWeights* w = &t->weights;
+    if (w->anon_copy) {
+        print_pages("weights", w->anon_copy, w->anon_copy_size, w->anon_backing);
+    } else if (!w->panel_copy && !w->panel_map && !w->aligned_copy && t->fd != -1) {
+        print_pages("weights", t->data, t->file_size, t->map_backing);
+    }
+}
+
+// ----------------------------------------------------------------------------
+// checkpoint fingerprint, of the files derived from a checkpoint: sessions and panel caches
+
+static uint64_t image_hash(const unsigned char* data, size_t size) {
+    // FNV-1a over the first 4 KB of the checkpoint image (of size bytes): its header and the start of
+    // the weights, which a re-export changes even when it keeps the size and lands in the same mtime second
+    size_t n = size < 4096 ? size : 4096;
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < n; i++) { h = (h ^ data[i]) * 0x100000001b3ULL; }
+    return h;
+}
+
+static uint64_t checkpoint_hash(int fd, size_t size) {
+    // image_hash of the file, not of a private mapping training may have written to
+    size_t n = size < 4096 ? size : 4096;
+    unsigned char* data = mmap(NULL, n, PROT_READ, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) { return 0; }
+    uint64_t h = image_hash(data, n);
+    munmap(data, n);
+    return h;
+}
+
+// ----------------------------------------------------------------------------
+// session snapshots: the kv cache up to pos, the position, the next token and the rng state,
+// so a long context resumes without running it through forward() again
+
+typedef struct {
+    uint32_t magic;    // SESSION_MAGIC
+    int version;       // of the checkpoint
+    Config config;     // with the context length run with
+    int64_t src_size;  // size and modification time of the checkpoint, a changed one invalidates the session
+    int64_t src_mtime;
+    uint64_t src_hash; // of its image, see image_hash(), also for an embedded one
+    int rope_scaling;
+    int kv_type, kv_page, n_sink, window; // the kv cache layout
+    // state, not compared
+    int pos;           // positions in the kv cache
+    int token;         // to forward at pos
+    uint64_t rng;
+    int n_pages;       // follow the header, WEIGHT_ALIGN aligned, kv_page_bytes() each
+} SessionHeader;
+
+static void session_header(SessionHeader* h, Transformer* t) {
+    // everything a snapshot must have been taken with to be valid for t
+    memset(h, 0, sizeof(*h)); // the padding is compared too
+    h->magic = SESSION_MAGIC;
+    h->version = t->version;
+    h->config = t->config;
+    struct stat st;
+    if (t->fd != -1 && fstat(t->fd, &st) == 0) {
+        h->src_size = st.st_size;
+        h->src_mtime = st.st_mtime;
+        h->src_hash = checkpoint_hash(t->fd, st.st_size);
+    } else if (t->fd == -1) {
+        h->src_size = t->file_size;
+        h->src_hash = image_hash((unsigned char*)t->data, t->file_size);
+    }
+    h->rope_scaling = t->rope_scaling;
+    KVCache* c = &t->state.kv;
+    h->kv_type = c->type;
+    h->kv_page = KV_PAGE;
+    h->n_sink = c->n_sink;
+    h->window = c->window;
+}
+
+int load_session(Transformer* t, char* path, int* pos, int* token, unsigned long long* rng) {
+    // point the kv cache into the snapshot at path if it was taken with this checkpoint and settings.
+    // the file is mapped privately: pages fault in as attention first reads them, and writes to
+    // them (the partly filled last page) stay in this process
+    FILE* f = fopen(path, "rb");
+    if (!f) { return 0; }
+    SessionHeader h, fh;
+    session_header(&h, t);
+    KVCache* c = &t->state.kv;
+    size_t off = (sizeof(h) + WEIGHT_ALIGN - 1) / WEIGHT_ALIGN * WEIGHT_ALIGN;
+    size_t size = 0;
+    int ok = fread(&fh, sizeof(fh), 1, f) == 1 && memcmp(&fh, &h, offsetof(SessionHeader, pos)) == 0
+          && fseek(f, 0, SEEK_END) == 0 && (size = ftell(f)) == off + (size_t)fh.n_pages * kv_page_bytes(c);
+    fclose(f);
+    if (!ok) { return 0; }
+    // the state is not covered by the fingerprint: it must be one save_session() could have written,
+    // or attention would read pages that are not there and the token would index past the embeddings
+    int slots = fh.pos < c->n_sink + c->window || !c->window ? fh.pos : c->n_sink + c->window;
+    if (fh.pos < 0 || (!c->window && fh.pos > c->seq_len) || fh.n_pages != (slots + KV_PAGE - 1) / KV_PAGE
+        || fh.token < 0 || fh.token >= t->config.vocab_size) {
+        return 0;
+    }
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) { return 0; }
+    char* map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) { return 0; }
+    kv_free_pages(c);
+    for (int i = 0; i < fh.n_pages; i++) { c->pages[i] = map + off + i * kv_page_bytes(c); }
+    c->n_alloc = fh.n_pages;
+    c->map = map;
+    c->map_size = size;
+    *pos = fh.pos;
+    *token = fh.token;
+    *rng = fh.rng;
+    return 1;
+}
+
+int save_session(Transformer* t, char* path, int pos, int token, unsigned long long rng) {
+    // snapshot the kv cache pages up to pos. written under a temporary name and renamed, so the
+    // session it may have been restored from stays mapped intact, and a crash leaves the old one
+    KVCache* c = &t->state.kv;
+    SessionHeader h;
+    session_header(&h, t);
+    int slots = c->window && pos > c->n_sink + c->window ? c->n_sink + c->window : pos;
+    h.pos = pos;
+    h.token = token;
+    h.rng = rng;
+    h.n_pages = (slots + KV_PAGE - 1) / KV_PAGE;
+    size_t off = (sizeof(h) + WEIGHT_ALIGN - 1) / WEIGHT_ALIGN * WEIGHT_ALIGN;
+    char tmp[strlen(path) + 5];
+    sprintf(tmp, "%s.tmp", path);
+    FILE* f = fopen(tmp, "wb");
+    static const char pad[WEIGHT_ALIGN];
+    int ok = f && fwrite(&h, sizeof(h), 1, f) == 1 && fwrite(pad, 1, off - sizeof(h), f) == off - sizeof(h);
+    for (int i = 0; ok && i < h.n_pages; i++) {
+        ok = fwrite(c->pages[i], 1, kv_page_bytes(c), f) == kv_page_bytes(c);
+    }
+    if (f && fclose(f) != 0) { ok = 0; }
+    if (!ok || rename(tmp, path) != 0) {
+        fprintf(stderr, "could not write the session %s\n", path);
+        remove(tmp);
+        return 0;
+    }
+    return 1;
+}
+
 // ----------------------------------------------------------------------------
 // neural net blocks; the dynamics of the Transformer
 
@@ -494,174 +1431,1827 @@ cblas_sgemv (const enum CBLAS_ORDER order, const enum CBLAS_TRANSPOSE TransA,
 }
 #endif
 
-static inline void matmul(float* __restrict__ xout, float* __restrict__ x, float* __restrict__ w, int n, int d) {
-    // W (d,n) @ x (n,) -> xout (d,)
-    // by far the most amount of time is spent inside this little function
-    #ifdef BLAS
-    cblas_sgemv(CblasRowMajor, CblasNoTrans, d, n, 1.0f, w, n, x, 1, 0.0f, xout, 1);
-    #else
-    int i;
-    #ifdef ACCEL
-    ACCEL(i) // OMP/OACC Macro
-    #endif
-    for (i = 0; i < d; i++) {
+static inline void quantize(int8_t* __restrict__ qx, float* __restrict__ sx, float* __restrict__ x, int n, int gs) {
+    // symmetric Q8_0 quantization of x (n,) in groups of gs values
+    for (int g = 0; g < n / gs; g++) {
+        float wmax = 0.0f;
+        for (int i = 0; i < gs; i++) {
+            float val = fabsf(x[g * gs + i]);
+            if (val > wmax) { wmax = val; }
+        }
+        // calculate the scaling factor such that float = quant * scale
+        float scale = wmax / 127.0f;
+        float inv = scale != 0.0f ? 1.0f / scale : 0.0f;
+        sx[g] = scale;
+        for (int i = 0; i < gs; i++) {
+            qx[g * gs + i] = (int8_t)roundf(x[g * gs + i] * inv);
+        }
+    }
+}
+
+static inline float half_to_fp32(uint16_t h, int bf16) {
+    // widen one fp16 or bf16 value to fp32
+    uint32_t bits;
+    if (bf16) {
+        bits = (uint32_t)h << 16;
+    } else {
+        uint32_t sign = (uint32_t)(h & 0x8000) << 16, exp = (h >> 10) & 0x1f, mant = h & 0x3ff;
+        if (exp == 0x1f) {
+            bits = sign | 0x7f800000 | (mant << 13); // inf / nan
+        } else if (exp != 0) {
+            bits = sign | ((exp + 112) << 23) | (mant << 13); // rebias 15 -> 127
+        } else if (mant == 0) {
+            bits = sign; // zero
+        } else {
+            // subnormal half, a normal float: shift the mantissa up to its implicit bit
+            exp = 113;
+            while (!(mant & 0x400)) { mant <<= 1; exp--; }
+            bits = sign | (exp << 23) | ((mant & 0x3ff) << 13);
+        }
+    }
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+static inline void dequantize_row(float* __restrict__ out, QuantizedTensor* w, int row, int n) {
+    // copy one row (n,) of w out as fp32, used for the token embedding lookup
+    size_t rb = values_bytes(w->type, n);
+    char* values = (char*)w->q + row * rb;
+    char buf[w->panel ? rb : 1];
+    if (w->panel) { unpanel_rows(buf, w, n, row, row + 1); values = buf; }
+    if (w->type == WT_FP32) {
+        memcpy(out, values, n * sizeof(float));
+        return;
+    }
+    if (w->type == WT_F16 || w->type == WT_BF16) {
+        uint16_t* h = (uint16_t*)values;
+        for (int i = 0; i < n; i++) { out[i] = half_to_fp32(h[i], w->type == WT_BF16); }
+        return;
+    }
+    float* s = w->s + (size_t)row * n / w->gs;
+    if (w->type == WT_Q4_0) {
+        uint8_t* q = (uint8_t*)values;
+        for (int b = 0; b < n; b += Q4_BLOCK) {
+            for (int k = 0; k < Q4_BLOCK / 2; k++) {
+                uint8_t byte = q[b / 2 + k];
+                out[b + k] = ((byte & 15) - 8) * s[b / w->gs];
+                out[b + k + Q4_BLOCK / 2] = ((byte >> 4) - 8) * s[b / w->gs];
+            }
+        }
+        return;
+    }
+    int8_t* q = (int8_t*)values;
+    for (int i = 0; i < n; i++) {
+        out[i] = q[i] * s[i / w->gs];
+    }
+}
+
+// ----------------------------------------------------------------------------
+// matmul kernels. each computes the rows [start, end) of W (d,n) @ x (n,)
+// the x86-64 SIMD variants are compiled for their instruction set via target
+// attributes and picked at startup with cpuid, so a plain -O3 build without
+// -march=native still gets AVX2/AVX-512 on machines that have it
+
+#if (defined(__x86_64__) || defined(_M_X64)) && (defined(__GNUC__) || defined(__clang__)) && !defined(NOSIMD) && !AD
+#define SIMD_X86
+#include <immintrin.h>
+#endif
+
+static void matmul_rows_scalar(float* __restrict__ xout, const float* __restrict__ x, const float* __restrict__ w, int n, int start, int end) {
+    for (int i = start; i < end; i++) {
         float val = 0.0f;
         for (int j = 0; j < n; j++) {
-            val += w[i * n + j] * x[j];
+            val += w[(size_t)i * n + j] * x[j];
         }
         xout[i] = val;
     }
-    #endif
 }
 
-//float* forward(Transformer* transformer, int token, int pos) {
-__attribute__((always_inline))
-static inline float* forward(int token, int pos, Config *__restrict__ p, TransformerWeights *__restrict__ w, RunState *__restrict__ s) {
-
-    // a few convenience variables
-    //Config* p = &transformer->config;
-    //TransformerWeights* w = &transformer->weights;
-    //RunState* s = &transformer->state;
-    float *x = s->x;
-    int dim = p->dim;
-    int kv_dim = (p->dim * p->n_kv_heads) / p->n_heads;
-    int kv_mul = p->n_heads / p->n_kv_heads; // integer multiplier of the kv sharing in multiquery
-    int hidden_dim =  p->hidden_dim;
-    int head_size = dim / p->n_heads;
-    
-    // copy the token embedding into x
-    float* content_row = w->token_embedding_table + token * dim;
-    memcpy(x, content_row, dim*sizeof(*x));
-
-    for(unsigned long long l = 0; l < p->n_layers; l++) {
+static inline void matmul_rows_half_scalar(float* __restrict__ xout, const float* __restrict__ x, const uint16_t* __restrict__ w,
+                                           int n, int start, int end, int bf16) {
+    for (int i = start; i < end; i++) {
+        float val = 0.0f;
+        for (int j = 0; j < n; j++) {
+            val += half_to_fp32(w[(size_t)i * n + j], bf16) * x[j];
+        }
+        xout[i] = val;
+    }
+}
 
-        // attention rmsnorm
-        rmsnorm(s->xb, x, w->rms_att_weight + l*dim, dim);
+static void matmul_rows_f16_scalar(float* __restrict__ xout, const float* __restrict__ x, const uint16_t* __restrict__ w, int n, int start, int end) {
+    matmul_rows_half_scalar(xout, x, w, n, start, end, 0);
+}
 
-        // qkv matmuls for this position
-        matmul(s->q, s->xb, w->wq + l*dim*dim, dim, dim);
-        matmul(s->k, s->xb, w->wk + l*dim*kv_dim, dim, kv_dim);
-        matmul(s->v, s->xb, w->wv + l*dim*kv_dim, dim, kv_dim);
+static void matmul_rows_bf16_scalar(float* __restrict__ xout, const float* __restrict__ x, const uint16_t* __restrict__ w, int n, int start, int end) {
+    matmul_rows_half_scalar(xout, x, w, n, start, end, 1);
+}
 
-        // RoPE relative positional encoding: complex-valued rotate q and k in each head
-        for (int i = 0; i < dim; i+=2) {
-            int head_dim = i % head_size;
-            float freq = 1.0f / powf(10000.0f, head_dim / (float)head_size);
-            float val = pos * freq;
-            float fcr = cosf(val);
-            float fci = sinf(val);
-            int rotn = i < kv_dim ? 2 : 1; // how many vectors? 2 = q & k, 1 = q only
-            for (int v = 0; v < rotn; v++) {
-                float* vec = v == 0 ? s->q : s->k; // the vector to rotate (query or key)
-                float v0 = vec[i];
-                float v1 = vec[i+1];
-                vec[i]   = v0 * fcr - v1 * fci;
-                vec[i+1] = v0 * fci + v1 * fcr;
+static void matmul_rows_q80_scalar(float* __restrict__ xout, const int8_t* __restrict__ xq, const float* __restrict__ xs,
+                                   const int8_t* __restrict__ wq, const float* __restrict__ ws, int n, int gs, int start, int end) {
+    for (int i = start; i < end; i++) {
+        const int8_t* row = wq + (size_t)i * n;
+        const float* rs = ws + (size_t)i * n / gs;
+        float val = 0.0f;
+        for (int j = 0; j < n; j += gs) {
+            int32_t ival = 0;
+            for (int k = 0; k < gs; k++) {
+                ival += (int32_t)xq[j + k] * (int32_t)row[j + k];
             }
+            val += (float)ival * rs[j / gs] * xs[j / gs];
         }
+        xout[i] = val;
+    }
+}
 
-        // save key,value at this time step (pos) to our kv cache
-        int loff = l * p->seq_len * kv_dim; // kv cache layer offset for convenience
-        float* key_cache_row = s->key_cache + loff + pos * kv_dim;
-        float* value_cache_row = s->value_cache + loff + pos * kv_dim;
-        memcpy(key_cache_row, s->k, kv_dim * sizeof(*key_cache_row));
-        memcpy(value_cache_row, s->v, kv_dim * sizeof(*value_cache_row));
-
-        // multihead attention. iterate over all heads
-        int h;
-        #ifdef ACCEL
-        ACCEL(h) // OMP/OACC Macro
-        #endif
-        for (h = 0; h < p->n_heads; h++) {
-            // get the query vector for this head
-            float* q = s->q + h * head_size;
-            // attention scores for this head
-            float* att = s->att + h * p->seq_len;
-            // iterate over all timesteps, including the current one
-            for (int t = 0; t <= pos; t++) {
-                // get the key vector for this head and at this timestep
-                float* k = s->key_cache + loff + t * kv_dim + (h / kv_mul) * head_size;
+static void matmul_rows_q40_scalar(float* __restrict__ xout, const int8_t* __restrict__ xq, const float* __restrict__ xs,
+                                   const uint8_t* __restrict__ wq, const float* __restrict__ ws, int n, int gs, int start, int end) {
+    // the nibbles are unpacked to [-8,7] on the fly, W never exists in memory wider than 4 bits
+    for (int i = start; i < end; i++) {
+        const uint8_t* row = wq + (size_t)i * n / 2;
+        const float* rs = ws + (size_t)i * n / gs;
+        float val = 0.0f;
+        for (int j = 0; j < n; j += gs) {
+            int32_t ival = 0;
+            for (int b = j; b < j + gs; b += Q4_BLOCK) {
+                for (int k = 0; k < Q4_BLOCK / 2; k++) {
+                    uint8_t byte = row[b / 2 + k];
+                    ival += ((int32_t)(byte & 15) - 8) * xq[b + k];
+                    ival += ((int32_t)(byte >> 4) - 8) * xq[b + k + Q4_BLOCK / 2];
+                }
+            }
+            val += (float)ival * rs[j / gs] * xs[j / gs];
+        }
+        xout[i] = val;
+    }
+}
+
+#ifdef SIMD_X86
+// the fp32 kernels walk 4 rows of W per pass so every load of x feeds 4 FMA chains
+
+__attribute__((target("sse2")))
+static void matmul_rows_sse2(float* __restrict__ xout, const float* __restrict__ x, const float* __restrict__ w, int n, int start, int end) {
+    int i = start;
+    for (; i + 4 <= end; i += 4) {
+        const float* w0 = w + (size_t)i * n;
+        const float* w1 = w0 + n;
+        const float* w2 = w1 + n;
+        const float* w3 = w2 + n;
+        __m128 a0 = _mm_setzero_ps(), a1 = _mm_setzero_ps(), a2 = _mm_setzero_ps(), a3 = _mm_setzero_ps();
+        int j = 0;
+        for (; j + 4 <= n; j += 4) {
+            __m128 xv = _mm_loadu_ps(x + j);
+            a0 = _mm_add_ps(a0, _mm_mul_ps(_mm_loadu_ps(w0 + j), xv));
+            a1 = _mm_add_ps(a1, _mm_mul_ps(_mm_loadu_ps(w1 + j), xv));
+            a2 = _mm_add_ps(a2, _mm_mul_ps(_mm_loadu_ps(w2 + j), xv));
+            a3 = _mm_add_ps(a3, _mm_mul_ps(_mm_loadu_ps(w3 + j), xv));
+        }
+        // transpose-add the 4 accumulators into one vector holding the 4 row sums
+        _MM_TRANSPOSE4_PS(a0, a1, a2, a3);
+        float r[4];
+        _mm_storeu_ps(r, _mm_add_ps(_mm_add_ps(a0, a1), _mm_add_ps(a2, a3)));
+        for (; j < n; j++) {
+            r[0] += w0[j] * x[j];
+            r[1] += w1[j] * x[j];
+            r[2] += w2[j] * x[j];
+            r[3] += w3[j] * x[j];
+        }
+        memcpy(xout + i, r, sizeof(r));
+    }
+    matmul_rows_scalar(xout, x, w, n, i, end);
+}
+
+__attribute__((target("avx2,fma")))
+static inline float hsum_avx2(__m256 v) {
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+    return _mm_cvtss_f32(s);
+}
+
+__attribute__((target("avx2,fma")))
+static void matmul_rows_avx2(float* __restrict__ xout, const float* __restrict__ x, const float* __restrict__ w, int n, int start, int end) {
+    int i = start;
+    for (; i + 4 <= end; i += 4) {
+        const float* w0 = w + (size_t)i * n;
+        const float* w1 = w0 + n;
+        const float* w2 = w1 + n;
+        const float* w3 = w2 + n;
+        __m256 a0 = _mm256_setzero_ps(), a1 = _mm256_setzero_ps(), a2 = _mm256_setzero_ps(), a3 = _mm256_setzero_ps();
+        int j = 0;
+        for (; j + 8 <= n; j += 8) {
+            __m256 xv = _mm256_loadu_ps(x + j);
+            a0 = _mm256_fmadd_ps(_mm256_loadu_ps(w0 + j), xv, a0);
+            a1 = _mm256_fmadd_ps(_mm256_loadu_ps(w1 + j), xv, a1);
+            a2 = _mm256_fmadd_ps(_mm256_loadu_ps(w2 + j), xv, a2);
+            a3 = _mm256_fmadd_ps(_mm256_loadu_ps(w3 + j), xv, a3);
+        }
+        float r0 = hsum_avx2(a0), r1 = hsum_avx2(a1), r2 = hsum_avx2(a2), r3 = hsum_avx2(a3);
+        for (; j < n; j++) {
+            r0 += w0[j] * x[j];
+            r1 += w1[j] * x[j];
+            r2 += w2[j] * x[j];
+            r3 += w3[j] * x[j];
+        }
+        xout[i] = r0; xout[i + 1] = r1; xout[i + 2] = r2; xout[i + 3] = r3;
+    }
+    matmul_rows_scalar(xout, x, w, n, i, end);
+}
+
+__attribute__((target("avx512f")))
+static void matmul_rows_avx512(float* __restrict__ xout, const float* __restrict__ x, const float* __restrict__ w, int n, int start, int end) {
+    int i = start;
+    for (; i + 4 <= end; i += 4) {
+        const float* w0 = w + (size_t)i * n;
+        const float* w1 = w0 + n;
+        const float* w2 = w1 + n;
+        const float* w3 = w2 + n;
+        __m512 a0 = _mm512_setzero_ps(), a1 = _mm512_setzero_ps(), a2 = _mm512_setzero_ps(), a3 = _mm512_setzero_ps();
+        int j = 0;
+        for (; j + 16 <= n; j += 16) {
+            __m512 xv = _mm512_loadu_ps(x + j);
+            a0 = _mm512_fmadd_ps(_mm512_loadu_ps(w0 + j), xv, a0);
+            a1 = _mm512_fmadd_ps(_mm512_loadu_ps(w1 + j), xv, a1);
+            a2 = _mm512_fmadd_ps(_mm512_loadu_ps(w2 + j), xv, a2);
+            a3 = _mm512_fmadd_ps(_mm512_loadu_ps(w3 + j), xv, a3);
+        }
+        if (j < n) { // masked tail, n is rarely not a multiple of 16
+            __mmask16 m = (__mmask16)((1u << (n - j)) - 1);
+            __m512 xv = _mm512_maskz_loadu_ps(m, x + j);
+            a0 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(m, w0 + j), xv, a0);
+            a1 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(m, w1 + j), xv, a1);
+            a2 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(m, w2 + j), xv, a2);
+            a3 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(m, w3 + j), xv, a3);
+        }
+        xout[i] = _mm512_reduce_add_ps(a0);
+        xout[i + 1] = _mm512_reduce_add_ps(a1);
+        xout[i + 2] = _mm512_reduce_add_ps(a2);
+        xout[i + 3] = _mm512_reduce_add_ps(a3);
+    }
+    matmul_rows_scalar(xout, x, w, n, i, end);
+}
+
+// fp16/bf16 weights are widened to fp32 in registers: vcvtph2ps (F16C / AVX-512F) for fp16,
+// a zero extend and 16 bit shift for bf16, which is exact and is all a bf16 -> fp32 conversion is.
+// x stays fp32, so the result matches the scalar kernels up to summation order
+
+__attribute__((target("avx2,fma,f16c")))
+static inline __m256 load8_half(const uint16_t* p, int bf16) {
+    __m128i h = _mm_loadu_si128((const __m128i*)p);
+    if (bf16) { return _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_cvtepu16_epi32(h), 16)); }
+    return _mm256_cvtph_ps(h);
+}
+
+__attribute__((target("avx2,fma,f16c")))
+static inline void matmul_rows_half_avx2(float* __restrict__ xout, const float* __restrict__ x, const uint16_t* __restrict__ w,
+                                         int n, int start, int end, int bf16) {
+    int i = start;
+    for (; i + 4 <= end; i += 4) {
+        const uint16_t* w0 = w + (size_t)i * n;
+        const uint16_t* w1 = w0 + n;
+        const uint16_t* w2 = w1 + n;
+        const uint16_t* w3 = w2 + n;
+        __m256 a0 = _mm256_setzero_ps(), a1 = _mm256_setzero_ps(), a2 = _mm256_setzero_ps(), a3 = _mm256_setzero_ps();
+        int j = 0;
+        for (; j + 8 <= n; j += 8) {
+            __m256 xv = _mm256_loadu_ps(x + j);
+            a0 = _mm256_fmadd_ps(load8_half(w0 + j, bf16), xv, a0);
+            a1 = _mm256_fmadd_ps(load8_half(w1 + j, bf16), xv, a1);
+            a2 = _mm256_fmadd_ps(load8_half(w2 + j, bf16), xv, a2);
+            a3 = _mm256_fmadd_ps(load8_half(w3 + j, bf16), xv, a3);
+        }
+        float r0 = hsum_avx2(a0), r1 = hsum_avx2(a1), r2 = hsum_avx2(a2), r3 = hsum_avx2(a3);
+        for (; j < n; j++) {
+            r0 += half_to_fp32(w0[j], bf16) * x[j];
+            r1 += half_to_fp32(w1[j], bf16) * x[j];
+            r2 += half_to_fp32(w2[j], bf16) * x[j];
+            r3 += half_to_fp32(w3[j], bf16) * x[j];
+        }
+        xout[i] = r0; xout[i + 1] = r1; xout[i + 2] = r2; xout[i + 3] = r3;
+    }
+    matmul_rows_half_scalar(xout, x, w, n, i, end, bf16);
+}
+
+__attribute__((target("avx2,fma,f16c")))
+static void matmul_rows_f16_avx2(float* __restrict__ xout, const float* __restrict__ x, const uint16_t* __restrict__ w, int n, int start, int end) {
+    matmul_rows_half_avx2(xout, x, w, n, start, end, 0);
+}
+
+__attribute__((target("avx2,fma,f16c")))
+static void matmul_rows_bf16_avx2(float* __restrict__ xout, const float* __restrict__ x, const uint16_t* __restrict__ w, int n, int start, int end) {
+    matmul_rows_half_avx2(xout, x, w, n, start, end, 1);
+}
+
+__attribute__((target("avx512f")))
+static inline __m512 load16_half(const uint16_t* p, int bf16) {
+    __m256i h = _mm256_loadu_si256((const __m256i*)p);
+    if (bf16) { return _mm512_castsi512_ps(_mm512_slli_epi32(_mm512_cvtepu16_epi32(h), 16)); }
+    return _mm512_cvtph_ps(h);
+}
+
+__attribute__((target("avx512f")))
+static inline void matmul_rows_half_avx512(float* __restrict__ xout, const float* __restrict__ x, const uint16_t* __restrict__ w,
+                                           int n, int start, int end, int bf16) {
+    int i = start;
+    for (; i + 4 <= end; i += 4) {
+        const uint16_t* w0 = w + (size_t)i * n;
+        const uint16_t* w1 = w0 + n;
+        const uint16_t* w2 = w1 + n;
+        const uint16_t* w3 = w2 + n;
+        __m512 a0 = _mm512_setzero_ps(), a1 = _mm512_setzero_ps(), a2 = _mm512_setzero_ps(), a3 = _mm512_setzero_ps();
+        int j = 0;
+        for (; j + 16 <= n; j += 16) {
+            __m512 xv = _mm512_loadu_ps(x + j);
+            a0 = _mm512_fmadd_ps(load16_half(w0 + j, bf16), xv, a0);
+            a1 = _mm512_fmadd_ps(load16_half(w1 + j, bf16), xv, a1);
+            a2 = _mm512_fmadd_ps(load16_half(w2 + j, bf16), xv, a2);
+            a3 = _mm512_fmadd_ps(load16_half(w3 + j, bf16), xv, a3);
+        }
+        float r0 = _mm512_reduce_add_ps(a0), r1 = _mm512_reduce_add_ps(a1);
+        float r2 = _mm512_reduce_add_ps(a2), r3 = _mm512_reduce_add_ps(a3);
+        for (; j < n; j++) {
+            r0 += half_to_fp32(w0[j], bf16) * x[j];
+            r1 += half_to_fp32(w1[j], bf16) * x[j];
+            r2 += half_to_fp32(w2[j], bf16) * x[j];
+            r3 += half_to_fp32(w3[j], bf16) * x[j];
+        }
+        xout[i] = r0; xout[i + 1] = r1; xout[i + 2] = r2; xout[i + 3] = r3;
+    }
+    matmul_rows_half_scalar(xout, x, w, n, i, end, bf16);
+}
+
+__attribute__((target("avx512f")))
+static void matmul_rows_f16_avx512(float* __restrict__ xout, const float* __restrict__ x, const uint16_t* __restrict__ w, int n, int start, int end) {
+    matmul_rows_half_avx512(xout, x, w, n, start, end, 0);
+}
+
+__attribute__((target("avx512f")))
+static void matmul_rows_bf16_avx512(float* __restrict__ xout, const float* __restrict__ x, const uint16_t* __restrict__ w, int n, int start, int end) {
+    matmul_rows_half_avx512(xout, x, w, n, start, end, 1);
+}
+
+// panel kernels: W repacked by repack_weights(), so the PANEL_ROWS rows of a pass are one
+// contiguous stream of PANEL_BYTES chunks, row after row. start and end are panel bounds
+
+__attribute__((target("avx2,fma")))
+static void matmul_panels_avx2(float* __restrict__ xout, const float* __restrict__ x, const float* __restrict__ w, int n, int start, int end) {
+    for (int i = start; i < end; i += PANEL_ROWS) {
+        const float* p = w + (size_t)i * n;
+        __m256 a0 = _mm256_setzero_ps(), a1 = _mm256_setzero_ps(), a2 = _mm256_setzero_ps(), a3 = _mm256_setzero_ps();
+        for (int j = 0; j < n; j += 16, p += 64) {
+            __m256 x0 = _mm256_loadu_ps(x + j), x1 = _mm256_loadu_ps(x + j + 8);
+            a0 = _mm256_fmadd_ps(_mm256_load_ps(p + 8), x1, _mm256_fmadd_ps(_mm256_load_ps(p), x0, a0));
+            a1 = _mm256_fmadd_ps(_mm256_load_ps(p + 24), x1, _mm256_fmadd_ps(_mm256_load_ps(p + 16), x0, a1));
+            a2 = _mm256_fmadd_ps(_mm256_load_ps(p + 40), x1, _mm256_fmadd_ps(_mm256_load_ps(p + 32), x0, a2));
+            a3 = _mm256_fmadd_ps(_mm256_load_ps(p + 56), x1, _mm256_fmadd_ps(_mm256_load_ps(p + 48), x0, a3));
+        }
+        xout[i] = hsum_avx2(a0); xout[i + 1] = hsum_avx2(a1); xout[i + 2] = hsum_avx2(a2); xout[i + 3] = hsum_avx2(a3);
+    }
+}
+
+__attribute__((target("avx512f")))
+static void matmul_panels_avx512(float* __restrict__ xout, const float* __restrict__ x, const float* __restrict__ w, int n, int start, int end) {
+    for (int i = start; i < end; i += PANEL_ROWS) {
+        const float* p = w + (size_t)i * n;
+        __m512 a0 = _mm512_setzero_ps(), a1 = _mm512_setzero_ps(), a2 = _mm512_setzero_ps(), a3 = _mm512_setzero_ps();
+        for (int j = 0; j < n; j += 16, p += 64) {
+            __m512 xv = _mm512_loadu_ps(x + j);
+            a0 = _mm512_fmadd_ps(_mm512_load_ps(p), xv, a0);
+            a1 = _mm512_fmadd_ps(_mm512_load_ps(p + 16), xv, a1);
+            a2 = _mm512_fmadd_ps(_mm512_load_ps(p + 32), xv, a2);
+            a3 = _mm512_fmadd_ps(_mm512_load_ps(p + 48), xv, a3);
+        }
+        xout[i] = _mm512_reduce_add_ps(a0);
+        xout[i + 1] = _mm512_reduce_add_ps(a1);
+        xout[i + 2] = _mm512_reduce_add_ps(a2);
+        xout[i + 3] = _mm512_reduce_add_ps(a3);
+    }
+}
+
+__attribute__((target("avx2,fma,f16c")))
+static inline void matmul_panels_half_avx2(float* __restrict__ xout, const float* __restrict__ x, const uint16_t* __restrict__ w,
+                                           int n, int start, int end, int bf16) {
+    for (int i = start; i < end; i += PANEL_ROWS) {
+        const uint16_t* p = w + (size_t)i * n;
+        __m256 acc[PANEL_ROWS];
+        for (int r = 0; r < PANEL_ROWS; r++) { acc[r] = _mm256_setzero_ps(); }
+        for (int j = 0; j < n; j += 32, p += 128) {
+            __m256 x0 = _mm256_loadu_ps(x + j), x1 = _mm256_loadu_ps(x + j + 8);
+            __m256 x2 = _mm256_loadu_ps(x + j + 16), x3 = _mm256_loadu_ps(x + j + 24);
+            for (int r = 0; r < PANEL_ROWS; r++) {
+                const uint16_t* c = p + r * 32;
+                acc[r] = _mm256_fmadd_ps(load8_half(c, bf16), x0, acc[r]);
+                acc[r] = _mm256_fmadd_ps(load8_half(c + 8, bf16), x1, acc[r]);
+                acc[r] = _mm256_fmadd_ps(load8_half(c + 16, bf16), x2, acc[r]);
+                acc[r] = _mm256_fmadd_ps(load8_half(c + 24, bf16), x3, acc[r]);
+            }
+        }
+        for (int r = 0; r < PANEL_ROWS; r++) { xout[i + r] = hsum_avx2(acc[r]); }
+    }
+}
+
+__attribute__((target("avx2,fma,f16c")))
+static void matmul_panels_f16_avx2(float* __restrict__ xout, const float* __restrict__ x, const uint16_t* __restrict__ w, int n, int start, int end) {
+    matmul_panels_half_avx2(xout, x, w, n, start, end, 0);
+}
+
+__attribute__((target("avx2,fma,f16c")))
+static void matmul_panels_bf16_avx2(float* __restrict__ xout, const float* __restrict__ x, const uint16_t* __restrict__ w, int n, int start, int end) {
+    matmul_panels_half_avx2(xout, x, w, n, start, end, 1);
+}
+
+__attribute__((target("avx512f")))
+static inline void matmul_panels_half_avx512(float* __restrict__ xout, const float* __restrict__ x, const uint16_t* __restrict__ w,
+                                             int n, int start, int end, int bf16) {
+    for (int i = start; i < end; i += PANEL_ROWS) {
+        const uint16_t* p = w + (size_t)i * n;
+        __m512 a0 = _mm512_setzero_ps(), a1 = _mm512_setzero_ps(), a2 = _mm512_setzero_ps(), a3 = _mm512_setzero_ps();
+        for (int j = 0; j < n; j += 32, p += 128) {
+            __m512 x0 = _mm512_loadu_ps(x + j), x1 = _mm512_loadu_ps(x + j + 16);
+            a0 = _mm512_fmadd_ps(load16_half(p + 16, bf16), x1, _mm512_fmadd_ps(load16_half(p, bf16), x0, a0));
+            a1 = _mm512_fmadd_ps(load16_half(p + 48, bf16), x1, _mm512_fmadd_ps(load16_half(p + 32, bf16), x0, a1));
+            a2 = _mm512_fmadd_ps(load16_half(p + 80, bf16), x1, _mm512_fmadd_ps(load16_half(p + 64, bf16), x0, a2));
+            a3 = _mm512_fmadd_ps(load16_half(p + 112, bf16), x1, _mm512_fmadd_ps(load16_half(p + 96, bf16), x0, a3));
+        }
+        xout[i] = _mm512_reduce_add_ps(a0);
+        xout[i + 1] = _mm512_reduce_add_ps(a1);
+        xout[i + 2] = _mm512_reduce_add_ps(a2);
+        xout[i + 3] = _mm512_reduce_add_ps(a3);
+    }
+}
+
+__attribute__((target("avx512f")))
+static void matmul_panels_f16_avx512(float* __restrict__ xout, const float* __restrict__ x, const uint16_t* __restrict__ w, int n, int start, int end) {
+    matmul_panels_half_avx512(xout, x, w, n, start, end, 0);
+}
+
+__attribute__((target("avx512f")))
+static void matmul_panels_bf16_avx512(float* __restrict__ xout, const float* __restrict__ x, const uint16_t* __restrict__ w, int n, int start, int end) {
+    matmul_panels_half_avx512(xout, x, w, n, start, end, 1);
+}
+
+__attribute__((target("avx2,fma")))
+static void matmul_panels_q80_avx2(float* __restrict__ xout, const int8_t* __restrict__ xq, const float* __restrict__ xs,
+                                   const int8_t* __restrict__ wq, const float* __restrict__ ws, int n, int gs, int start, int end) {
+    // 64 values of each row per chunk, the integer sums are flushed at every group end (gs % 32 == 0)
+    const __m256i ones = _mm256_set1_epi16(1);
+    for (int i = start; i < end; i += PANEL_ROWS) {
+        const int8_t* p = wq + (size_t)i * n;
+        __m256 acc[PANEL_ROWS];
+        __m256i isum[PANEL_ROWS];
+        for (int r = 0; r < PANEL_ROWS; r++) { acc[r] = _mm256_setzero_ps(); isum[r] = _mm256_setzero_si256(); }
+        for (int k = 0; k < n; k += 32) {
+            __m256i xv = _mm256_loadu_si256((const __m256i*)(xq + k));
+            __m256i xa = _mm256_sign_epi8(xv, xv);
+            const int8_t* c = p + (size_t)(k / 64) * (PANEL_ROWS * 64) + k % 64;
+            for (int r = 0; r < PANEL_ROWS; r++) {
+                __m256i wv = _mm256_load_si256((const __m256i*)(c + r * 64));
+                __m256i prod = _mm256_maddubs_epi16(xa, _mm256_sign_epi8(wv, xv));
+                isum[r] = _mm256_add_epi32(isum[r], _mm256_madd_epi16(prod, ones));
+            }
+            if ((k + 32) % gs == 0) {
+                for (int r = 0; r < PANEL_ROWS; r++) {
+                    float sc = ws[((size_t)(i + r) * n + k) / gs] * xs[k / gs];
+                    acc[r] = _mm256_fmadd_ps(_mm256_cvtepi32_ps(isum[r]), _mm256_set1_ps(sc), acc[r]);
+                    isum[r] = _mm256_setzero_si256();
+                }
+            }
+        }
+        for (int r = 0; r < PANEL_ROWS; r++) { xout[i + r] = hsum_avx2(acc[r]); }
+    }
+}
+
+__attribute__((target("avx2,fma")))
+static void matmul_panels_q40_avx2(float* __restrict__ xout, const int8_t* __restrict__ xq, const float* __restrict__ xs,
+                                   const uint8_t* __restrict__ wq, const float* __restrict__ ws, int n, int gs, int start, int end) {
+    // 128 values (4 Q4 blocks) of each row per chunk
+    const __m256i ones = _mm256_set1_epi16(1);
+    const __m256i low = _mm256_set1_epi8(15);
+    const __m256i eight = _mm256_set1_epi8(8);
+    for (int i = start; i < end; i += PANEL_ROWS) {
+        const uint8_t* p = wq + (size_t)i * n / 2;
+        __m256 acc[PANEL_ROWS];
+        __m256i isum[PANEL_ROWS];
+        for (int r = 0; r < PANEL_ROWS; r++) { acc[r] = _mm256_setzero_ps(); isum[r] = _mm256_setzero_si256(); }
+        for (int k = 0; k < n; k += Q4_BLOCK) {
+            __m256i xv = _mm256_loadu_si256((const __m256i*)(xq + k));
+            __m256i xa = _mm256_sign_epi8(xv, xv);
+            const uint8_t* c = p + (size_t)(k / 128) * (PANEL_ROWS * 64) + k % 128 / 2;
+            for (int r = 0; r < PANEL_ROWS; r++) {
+                __m128i packed = _mm_load_si128((const __m128i*)(c + r * 64));
+                __m256i both = _mm256_set_m128i(_mm_srli_epi16(packed, 4), packed);
+                __m256i wv = _mm256_sub_epi8(_mm256_and_si256(both, low), eight);
+                __m256i prod = _mm256_maddubs_epi16(xa, _mm256_sign_epi8(wv, xv));
+                isum[r] = _mm256_add_epi32(isum[r], _mm256_madd_epi16(prod, ones));
+            }
+            if ((k + Q4_BLOCK) % gs == 0) {
+                for (int r = 0; r < PANEL_ROWS; r++) {
+                    float sc = ws[((size_t)(i + r) * n + k) / gs] * xs[k / gs];
+                    acc[r] = _mm256_fmadd_ps(_mm256_cvtepi32_ps(isum[r]), _mm256_set1_ps(sc), acc[r]);
+                    isum[r] = _mm256_setzero_si256();
+                }
+            }
+        }
+        for (int r = 0; r < PANEL_ROWS; r++) { xout[i + r] = hsum_avx2(acc[r]); }
+    }
+}
+
+__attribute__((target("avx2,fma")))
+static void matmul_rows_q80_avx2(float* __restrict__ xout, const int8_t* __restrict__ xq, const float* __restrict__ xs,
+                                 const int8_t* __restrict__ wq, const float* __restrict__ ws, int n, int gs, int start, int end) {
+    if (gs % 32 != 0) { matmul_rows_q80_scalar(xout, xq, xs, wq, ws, n, gs, start, end); return; }
+    const __m256i ones = _mm256_set1_epi16(1);
+    for (int i = start; i < end; i++) {
+        const int8_t* row = wq + (size_t)i * n;
+        const float* rs = ws + (size_t)i * n / gs;
+        __m256 acc = _mm256_setzero_ps();
+        for (int j = 0; j < n; j += gs) {
+            __m256i isum = _mm256_setzero_si256();
+            for (int k = j; k < j + gs; k += 32) {
+                __m256i xv = _mm256_loadu_si256((const __m256i*)(xq + k));
+                __m256i wv = _mm256_loadu_si256((const __m256i*)(row + k));
+                // maddubs wants one unsigned operand: move the sign of x onto w (values are in [-127,127])
+                __m256i p = _mm256_maddubs_epi16(_mm256_sign_epi8(xv, xv), _mm256_sign_epi8(wv, xv));
+                isum = _mm256_add_epi32(isum, _mm256_madd_epi16(p, ones));
+            }
+            acc = _mm256_fmadd_ps(_mm256_cvtepi32_ps(isum), _mm256_set1_ps(rs[j / gs] * xs[j / gs]), acc);
+        }
+        xout[i] = hsum_avx2(acc);
+    }
+}
+
+__attribute__((target("avx2,fma")))
+static void matmul_rows_q40_avx2(float* __restrict__ xout, const int8_t* __restrict__ xq, const float* __restrict__ xs,
+                                 const uint8_t* __restrict__ wq, const float* __restrict__ ws, int n, int gs, int start, int end) {
+    const __m256i ones = _mm256_set1_epi16(1);
+    const __m256i low = _mm256_set1_epi8(15);
+    const __m256i eight = _mm256_set1_epi8(8);
+    for (int i = start; i < end; i++) {
+        const uint8_t* row = wq + (size_t)i * n / 2;
+        const float* rs = ws + (size_t)i * n / gs;
+        __m256 acc = _mm256_setzero_ps();
+        for (int j = 0; j < n; j += gs) {
+            __m256i isum = _mm256_setzero_si256();
+            for (int b = j; b < j + gs; b += Q4_BLOCK) {
+                // 16 bytes -> 32 values: low nibbles are values 0..15, high nibbles 16..31
+                __m128i packed = _mm_loadu_si128((const __m128i*)(row + b / 2));
+                __m256i both = _mm256_set_m128i(_mm_srli_epi16(packed, 4), packed);
+                __m256i wv = _mm256_sub_epi8(_mm256_and_si256(both, low), eight);
+                __m256i xv = _mm256_loadu_si256((const __m256i*)(xq + b));
+                __m256i p = _mm256_maddubs_epi16(_mm256_sign_epi8(xv, xv), _mm256_sign_epi8(wv, xv));
+                isum = _mm256_add_epi32(isum, _mm256_madd_epi16(p, ones));
+            }
+            acc = _mm256_fmadd_ps(_mm256_cvtepi32_ps(isum), _mm256_set1_ps(rs[j / gs] * xs[j / gs]), acc);
+        }
+        xout[i] = hsum_avx2(acc);
+    }
+}
+#endif
+
+typedef struct {
+    const char* name;
+    void (*rows)(float* xout, const float* x, const float* w, int n, int start, int end);
+    void (*rows_q80)(float* xout, const int8_t* xq, const float* xs, const int8_t* wq, const float* ws, int n, int gs, int start, int end);
+    void (*rows_q40)(float* xout, const int8_t* xq, const float* xs, const uint8_t* wq, const float* ws, int n, int gs, int start, int end);
+    void (*rows_f16)(float* xout, const float* x, const uint16_t* w, int n, int start, int end);
+    void (*rows_bf16)(float* xout, const float* x, const uint16_t* w, int n, int start, int end);
+    // the same on repacked weights, NULL where there is no panel kernel (the tensor stays row-major)
+    void (*panels)(float* xout, const float* x, const float* w, int n, int start, int end);
+    void (*panels_q80)(float* xout, const int8_t* xq, const float* xs, const int8_t* wq, const float* ws, int n, int gs, int start, int end);
+    void (*panels_q40)(float* xout, const int8_t* xq, const float* xs, const uint8_t* wq, const float* ws, int n, int gs, int start, int end);
+    void (*panels_f16)(float* xout, const float* x, const uint16_t* w, int n, int start, int end);
+    void (*panels_bf16)(float* xout, const float* x, const uint16_t* w, int n, int start, int end);
+} Kernels;
+
+static Kernels kernels = { .name = "scalar", .rows = matmul_rows_scalar, .rows_q80 = matmul_rows_q80_scalar,
+                           .rows_q40 = matmul_rows_q40_scalar, .rows_f16 = matmul_rows_f16_scalar,
+                           .rows_bf16 = matmul_rows_bf16_scalar };
+
+void init_kernels() {
+    // pick the widest kernels this cpu supports
+#ifdef SIMD_X86
+    __builtin_cpu_init();
+    kernels = (Kernels){ .name = "sse2", .rows = matmul_rows_sse2, .rows_q80 = matmul_rows_q80_scalar,
+                         .rows_q40 = matmul_rows_q40_scalar, .rows_f16 = matmul_rows_f16_scalar,
+                         .rows_bf16 = matmul_rows_bf16_scalar };
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        kernels = (Kernels){ .name = "avx2", .rows = matmul_rows_avx2, .rows_q80 = matmul_rows_q80_avx2,
+                             .rows_q40 = matmul_rows_q40_avx2, .rows_f16 = kernels.rows_f16,
+                             .rows_bf16 = matmul_rows_bf16_avx2,
+                             .panels = matmul_panels_avx2, .panels_q80 = matmul_panels_q80_avx2,
+                             .panels_q40 = matmul_panels_q40_avx2, .panels_bf16 = matmul_panels_bf16_avx2 };
+        if (__builtin_cpu_supports("f16c")) {
+            kernels.rows_f16 = matmul_rows_f16_avx2;
+            kernels.panels_f16 = matmul_panels_f16_avx2;
+        }
+    }
+    if (__builtin_cpu_supports("avx512f")) {
+        kernels = (Kernels){ .name = "avx512", .rows = matmul_rows_avx512, .rows_q80 = kernels.rows_q80,
+                             .rows_q40 = kernels.rows_q40, .rows_f16 = matmul_rows_f16_avx512,
+                             .rows_bf16 = matmul_rows_bf16_avx512,
+                             .panels = matmul_panels_avx512, .panels_q80 = kernels.panels_q80,
+                             .panels_q40 = kernels.panels_q40, .panels_f16 = matmul_panels_f16_avx512,
+                             .panels_bf16 = matmul_panels_bf16_avx512 };
+    }
+#endif
+}
+
+// ----------------------------------------------------------------------------
+// load-time repacking into panels for the SIMD kernels, with a cache file
+
+typedef struct {
+    uint32_t magic;    // PANEL_MAGIC
+    int version;       // of the checkpoint the image was made from
+    Config config;
+    int panel_rows;    // PANEL_ROWS
+    int panel_bytes;   // PANEL_BYTES
+    int fused;         // the image has wqkv instead of wq, wk and wv
+    int n_regions;     // followed by one byte per region, 1 = repacked
+    int64_t src_size;  // size and modification time of the checkpoint
+    int64_t src_mtime;
+    uint64_t src_hash; // of its header and first page, see image_hash()
+    uint64_t image_size;
+} PanelHeader;
+
+static int panel_ok(QuantizedTensor* t, int n) {
+    // can t, with rows of n values, be repacked for the active kernels
+    void* kernel = t->type == WT_FP32 ? (void*)kernels.panels : t->type == WT_F16 ? (void*)kernels.panels_f16
+                 : t->type == WT_BF16 ? (void*)kernels.panels_bf16 : t->type == WT_Q8_0 ? (void*)kernels.panels_q80
+                 : (void*)kernels.panels_q40;
+    #ifdef BLAS
+    if (t->type == WT_FP32) { return 0; } // cblas wants row-major
+    #endif
+    return kernel != NULL && values_bytes(t->type, n) % PANEL_BYTES == 0 && (!is_quantized(t->type) || t->gs % 32 == 0);
+}
+
+static void pack_panels(char* dst, QuantizedTensor* t, int n) {
+    // rows i..i+PANEL_ROWS of t become one panel: chunk c of every row, then chunk c+1 of every row, ...
+    // the last panel holds the d % PANEL_ROWS leftover rows the same way
+    size_t rb = values_bytes(t->type, n), d = t->n / n;
+    char* src = t->q;
+    for (size_t i = 0; i < d; i += PANEL_ROWS) {
+        size_t rc = d - i < PANEL_ROWS ? d - i : PANEL_ROWS;
+        for (size_t r = 0; r < rc; r++) {
+            for (size_t c = 0; c < rb / PANEL_BYTES; c++) {
+                memcpy(dst + i * rb + (c * rc + r) * PANEL_BYTES, src + (i + r) * rb + c * PANEL_BYTES, PANEL_BYTES);
+            }
+        }
+    }
+}
+
+static int map_panel_cache(TransformerWeights* w, WeightRegion* r, int n, PanelHeader* h, unsigned char* packed, size_t off, char* path) {
+    // point the weights into the cache file if it was made from this checkpoint with these settings
+    FILE* f = fopen(path, "rb");
+    if (!f) { return 0; }
+    PanelHeader fh;
+    unsigned char flags[n];
+    int ok = fread(&fh, sizeof(fh), 1, f) == 1 && fread(flags, 1, n, f) == (size_t)n
+          && memcmp(&fh, h, sizeof(fh)) == 0 && memcmp(flags, packed, n) == 0
+          && fseek(f, 0, SEEK_END) == 0 && (uint64_t)ftell(f) == off + h->image_size;
+    fclose(f);
+    if (!ok) { return 0; }
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) { return 0; }
+    char* map = mmap(NULL, off + h->image_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) { return 0; }
+    char* dst = map + off;
+    for (int i = 0; i < n; i++) {
+        if (r[i].bytes == 0) { continue; }
+        *r[i].ptr = dst;
+        if (r[i].t) { r[i].t->panel = packed[i] ? PANEL_ROWS : 0; }
+        dst += (r[i].bytes + WEIGHT_ALIGN - 1) / WEIGHT_ALIGN * WEIGHT_ALIGN;
+    }
+    w->panel_map = map;
+    w->panel_map_size = off + h->image_size;
+    return 1;
+}
+
+void repack_weights(TransformerWeights* w, Config* p, int version, int fuse, int fd, char* cache_path, int stats) {
+    // interleave every matrix there is a panel kernel for into PANEL_ROWS row panels, so a kernel
+    // pass streams one contiguous buffer instead of PANEL_ROWS rows far apart. all the weights are
+    // copied into one image in forward order; with a cache path the image is written to that file
+    // once, and later runs map it instead of repacking (fuse: see fuse_qkv, also cached)
+    if (fuse) { fuse_qkv(w, p, 0); }
+    int n = weight_regions(w, p, NULL);
+    WeightRegion* r = malloc(n * sizeof(WeightRegion));
+    unsigned char* packed = malloc(n);
+    if (!r || !packed) { fprintf(stderr, "malloc failed!\n"); exit(EXIT_FAILURE); }
+    weight_regions(w, p, r);
+    PanelHeader h;
+    memset(&h, 0, sizeof(h)); // the padding is compared too
+    h.magic = PANEL_MAGIC;
+    h.version = version;
+    h.config = *p;
+    h.panel_rows = PANEL_ROWS;
+    h.panel_bytes = PANEL_BYTES;
+    h.fused = fuse;
+    h.n_regions = n;
+    struct stat st;
+    if (fd != -1 && fstat(fd, &st) == 0) {
+        h.src_size = st.st_size;
+        h.src_mtime = st.st_mtime;
+        h.src_hash = checkpoint_hash(fd, st.st_size);
+    }
+    for (int i = 0; i < n; i++) {
+        QuantizedTensor* t = r[i].t;
+        packed[i] = t != NULL && panel_ok(t, tensor_cols(w, p, t));
+        h.image_size += (r[i].bytes + WEIGHT_ALIGN - 1) / WEIGHT_ALIGN * WEIGHT_ALIGN;
+    }
+    int any = 0;
+    for (int i = 0; i < n; i++) { any |= packed[i]; }
+    size_t off = (sizeof(h) + n + WEIGHT_ALIGN - 1) / WEIGHT_ALIGN * WEIGHT_ALIGN;
+    if (!any || (cache_path && map_panel_cache(w, r, n, &h, packed, off, cache_path))) {
+        // (no panel kernels, e.g. a NOSIMD build: the weights stay as they are)
+        if (!any && fuse) {
+            free(w->wqkv);
+            fuse_qkv(w, p, 1);
+        }
+        free(r);
+        free(packed);
+        return;
+    }
+
+    // no usable cache: repack from the checkpoint
+    if (fuse) {
+        free(w->wqkv);
+        fuse_qkv(w, p, 1);
+        weight_regions(w, p, r);
+    }
+    char* image = aligned_alloc(WEIGHT_ALIGN, h.image_size);
+    if (!image) { fprintf(stderr, "malloc failed!\n"); exit(EXIT_FAILURE); }
+    char* dst = image;
+    for (int i = 0; i < n; i++) {
+        if (r[i].bytes == 0) { continue; }
+        if (packed[i]) {
+            QuantizedTensor* t = r[i].t;
+            pack_panels(dst, t, tensor_cols(w, p, t));
+            t->panel = PANEL_ROWS;
+        } else {
+            memcpy(dst, *r[i].ptr, r[i].bytes);
+        }
+        *r[i].ptr = dst;
+        dst += (r[i].bytes + WEIGHT_ALIGN - 1) / WEIGHT_ALIGN * WEIGHT_ALIGN;
+    }
+    // everything lives in the image now
+    free(w->aligned_copy);
+    free(w->qkv_copy);
+    free(w->qkv_scales);
+    w->aligned_copy = w->qkv_copy = w->qkv_scales = NULL;
+    w->panel_copy = image;
+
+    if (cache_path) {
+        // written under a temporary name and renamed, so a concurrent run never maps half a file
+        char tmp[strlen(cache_path) + 5];
+        sprintf(tmp, "%s.tmp", cache_path);
+        FILE* f = fopen(tmp, "wb");
+        static const char pad[WEIGHT_ALIGN];
+        int ok = f && fwrite(&h, sizeof(h), 1, f) == 1 && fwrite(packed, 1, n, f) == (size_t)n
+              && fwrite(pad, 1, off - sizeof(h) - n, f) == off - sizeof(h) - n
+              && fwrite(image, 1, h.image_size, f) == h.image_size;
+        if (f && fclose(f) != 0) { ok = 0; }
+        if (!ok || rename(tmp, cache_path) != 0) {
+            // e.g. a read-only model directory: the next run repacks again, which is only slower
+            if (stats) { fprintf(stderr, "could not write the repack cache %s\n", cache_path); }
+            remove(tmp);
+        }
+    }
+    free(r);
+    free(packed);
+}
+
+// ----------------------------------------------------------------------------
+// Persistent thread pool (THREADS builds)
+// the workers are started once and reused by every parallel loop of forward(), instead of
+// an OpenMP fork/join per matmul. a loop over n items is split statically into one
+// contiguous range per thread, so each thread walks the same weight rows every token.
+// workers wait for the next loop by spinning on a generation counter, then on a futex
+
+#ifdef THREADS
+#define POOL_SPIN (1 << 14) // pause iterations before a waiting thread goes to sleep
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define cpu_relax() __asm__ __volatile__("yield")
+#else
+#define cpu_relax() ((void)0)
+#endif
+
+enum { SPIN_SLEEP = 0, SPIN_THEN_SLEEP = 1, SPIN_ALWAYS = 2 };
+
+typedef struct {
+    int n_threads;          // including the main thread
+    int spin;               // SPIN_SLEEP, SPIN_THEN_SLEEP or SPIN_ALWAYS
+    pthread_t* threads;     // n_threads - 1 workers
+    int* cpu;               // the cpu each thread is pinned to, -1 = not pinned
+    int n_nodes;            // numa nodes the threads are spread over, see numa_spread_weights()
+    void (*fn)(void*, int, int); // the current loop, called on a range [start, end) of its items
+    void* ctx;
+    int n;                  // items of the current loop
+    unsigned int gen;       // bumped by the main thread to start a loop
+    unsigned int pending;   // workers that have not finished the current loop
+    unsigned int sleepers;  // threads inside futex_wait, wakes are skipped while 0
+    int quit;
+} ThreadPool;
+
+static ThreadPool pool = { .n_threads = 1, .spin = SPIN_THEN_SLEEP, .n_nodes = 1 };
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER; // one loop at a time, libl2e contexts on other threads wait
+
+static void futex_wait(unsigned int* addr, unsigned int val) {
+#ifdef __linux__
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+#else
+    sched_yield();
+#endif
+}
+
+static void futex_wake(unsigned int* addr) {
+#ifdef __linux__
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, INT32_MAX, NULL, NULL, 0);
+#endif
+}
+
+static void pool_wait(unsigned int* addr, unsigned int val) {
+    // returns once *addr != val
+    for (int i = 0; __atomic_load_n(addr, __ATOMIC_ACQUIRE) == val; i++) {
+        if (pool.spin == SPIN_ALWAYS || (pool.spin == SPIN_THEN_SLEEP && i < POOL_SPIN)) {
+            cpu_relax();
+            continue;
+        }
+        __atomic_add_fetch(&pool.sleepers, 1, __ATOMIC_SEQ_CST);
+        futex_wait(addr, val); // sleeps only if *addr still == val, so a wake can't be missed
+        __atomic_sub_fetch(&pool.sleepers, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+static void pool_wake(unsigned int* addr) {
+    if (__atomic_load_n(&pool.sleepers, __ATOMIC_SEQ_CST)) { futex_wake(addr); }
+}
+
+static inline void pool_range(int n, int id, int* start, int* end) {
+    *start = (int)((long)n * id / pool.n_threads);
+    *end = (int)((long)n * (id + 1) / pool.n_threads);
+}
+
+#ifdef NUMA
+#define NUMA_MAX_NODES 64
+#define NUMA_MAX_CPUS 4096
+
+static int pin_cpu(int cpu) {
+    // pin the calling thread to one cpu
+    unsigned long mask[NUMA_MAX_CPUS / (8 * sizeof(unsigned long))] = {0};
+    mask[cpu / (8 * sizeof(unsigned long))] |= 1UL << (cpu % (8 * sizeof(unsigned long)));
+    return syscall(SYS_sched_setaffinity, 0, sizeof(mask), mask) == 0;
+}
+
+static int numa_cpus(int** cpus, int* node_of) {
+    // the cpus we may run on, grouped by numa node: cpus[k] lists node k's, -1 terminated.
+    // node_of[k] is its node number. returns the number of nodes that have such cpus
+    unsigned long allowed[NUMA_MAX_CPUS / (8 * sizeof(unsigned long))] = {0};
+    if (syscall(SYS_sched_getaffinity, 0, sizeof(allowed), allowed) <= 0) { return 0; }
+    int n = 0;
+    for (int node = 0; node < NUMA_MAX_NODES; node++) {
+        char path[64];
+        sprintf(path, "/sys/devices/system/node/node%d/cpulist", node);
+        FILE* f = fopen(path, "r");
+        if (!f) { continue; }
+        // e.g. "0-15,32-47"
+        int* list = malloc((NUMA_MAX_CPUS + 1) * sizeof(int)), count = 0, a, b;
+        if (!list) { fprintf(stderr, "malloc failed!\n"); exit(EXIT_FAILURE); }
+        while (fscanf(f, "%d", &a) == 1) {
+            b = a;
+            int c = fgetc(f);
+            if (c == '-') { if (fscanf(f, "%d", &b) != 1) { break; } c = fgetc(f); }
+            for (int cpu = a; cpu <= b && cpu < NUMA_MAX_CPUS; cpu++) {
+                if (allowed[cpu / (8 * sizeof(unsigned long))] >> (cpu % (8 * sizeof(unsigned long))) & 1) { list[count++] = cpu; }
+            }
+            if (c != ',') { break; }
+        }
+        fclose(f);
+        list[count] = -1;
+        if (count == 0) { free(list); continue; }
+        cpus[n] = list;
+        node_of[n++] = node;
+    }
+    return n;
+}
+
+static void numa_pin_threads(int n_threads) {
+    // spread the threads over the nodes in contiguous groups, thread t on node t * n_nodes / n_threads,
+    // and pin each to a cpu of its node. pool_range() hands out contiguous ranges in thread order,
+    // so each node computes one contiguous slice of every loop
+    int* cpus[NUMA_MAX_NODES];
+    int node_of[NUMA_MAX_NODES];
+    int found = numa_cpus(cpus, node_of);
+    int n_nodes = found < n_threads ? found : n_threads;
+    if (n_nodes > 1) {
+        for (int t = 0; t < n_threads; t++) {
+            int k = (int)((long)t * n_nodes / n_threads);
+            int first = (int)(((long)k * n_threads + n_nodes - 1) / n_nodes); // first thread on node k
+            int count = 0;
+            while (cpus[k][count] != -1) { count++; }
+            pool.cpu[t] = cpus[k][(t - first) % count];
+        }
+        pool.n_nodes = n_nodes;
+        fprintf(stderr, "numa: %d threads over nodes", n_threads);
+        for (int k = 0; k < n_nodes; k++) { fprintf(stderr, " %d", node_of[k]); }
+        fprintf(stderr, "\n");
+    }
+    for (int k = 0; k < found; k++) { free(cpus[k]); }
+}
+#endif
+
+static void* pool_worker(void* arg) {
+    int id = (int)(intptr_t)arg;
+    unsigned int gen = 0;
+#ifdef NUMA
+    if (pool.cpu[id] >= 0 && !pin_cpu(pool.cpu[id])) { fprintf(stderr, "numa: could not pin thread %d\n", id); }
+#endif
+    for (;;) {
+        pool_wait(&pool.gen, gen);
+        gen = __atomic_load_n(&pool.gen, __ATOMIC_ACQUIRE);
+        if (pool.quit) { return NULL; }
+        int start, end;
+        pool_range(pool.n, id, &start, &end);
+        if (start < end) { pool.fn(pool.ctx, start, end); }
+        if (__atomic_sub_fetch(&pool.pending, 1, __ATOMIC_SEQ_CST) == 0) { pool_wake(&pool.pending); }
+    }
+}
+
+static void pool_run(void (*fn)(void*, int, int), void* ctx, int n) {
+    // fn(ctx, start, end) over the items [0, n), split across the pool. returns when all are done
+    if (pool.n_threads == 1 || n < 2) { fn(ctx, 0, n); return; }
+    pthread_mutex_lock(&pool_lock);
+    pool.fn = fn;
+    pool.ctx = ctx;
+    pool.n = n;
+    __atomic_store_n(&pool.pending, pool.n_threads - 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&pool.gen, 1, __ATOMIC_SEQ_CST);
+    pool_wake(&pool.gen);
+    int start, end;
+    pool_range(n, 0, &start, &end);
+    fn(ctx, start, end); // the main thread takes the first range
+    unsigned int left;
+    while ((left = __atomic_load_n(&pool.pending, __ATOMIC_ACQUIRE)) != 0) { pool_wait(&pool.pending, left); }
+    pthread_mutex_unlock(&pool_lock);
+}
+
+void pool_init(int n_threads, int spin, int numa) {
+    // n_threads <= 0: one per online cpu. numa: spread and pin the threads over the numa nodes
+    int cpus = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (n_threads <= 0) { n_threads = cpus; }
+    if (n_threads < 1) { n_threads = 1; }
+    pool.n_threads = n_threads;
+    // with more threads than cpus a spinning thread burns the time slice another one needs
+    pool.spin = n_threads > cpus && cpus > 0 ? SPIN_SLEEP : spin;
+    pool.quit = 0;
+    pool.n_nodes = 1;
+    pool.threads = malloc((n_threads - 1) * sizeof(pthread_t));
+    pool.cpu = malloc(n_threads * sizeof(int));
+    if (!pool.threads || !pool.cpu) { fprintf(stderr, "malloc failed!\n"); exit(EXIT_FAILURE); }
+    for (int i = 0; i < n_threads; i++) { pool.cpu[i] = -1; }
+#ifdef NUMA
+    if (numa) { numa_pin_threads(n_threads); }
+    if (pool.cpu[0] >= 0 && !pin_cpu(pool.cpu[0])) { fprintf(stderr, "numa: could not pin thread 0\n"); }
+#else
+    (void)numa;
+#endif
+    for (int i = 1; i < n_threads; i++) {
+        if (pthread_create(&pool.threads[i - 1], NULL, pool_worker, (void*)(intptr_t)i) != 0) {
+            fprintf(stderr, "pthread_create failed\n"); exit(EXIT_FAILURE);
+        }
+    }
+}
+
+void pool_free() {
+    pool.quit = 1;
+    __atomic_add_fetch(&pool.gen, 1, __ATOMIC_SEQ_CST);
+    futex_wake(&pool.gen);
+    for (int i = 1; i < pool.n_threads; i++) { pthread_join(pool.threads[i - 1], NULL); }
+    free(pool.threads);
+    free(pool.cpu);
+    pool.threads = NULL;
+    pool.cpu = NULL;
+    pool.n_threads = 1;
+}
+
+#ifdef NUMA
+typedef struct {
+    char* dst;
+    char* src;
+    float* dst_s;
+    float* src_s;
+    size_t row_bytes, row_scales; // per row of the matrix
+    int d;
+} SpreadTask;
+
+static void spread_task(void* arg, int start, int end) {
+    // copy the blocks of MATMUL_ROWS rows [start, end): the same blocks, on the same thread, as in matmul().
+    // the copy is the first touch of its pages, which places them on this thread's node.
+    // a repacked panel holds the same rows as a block, so the row ranges are the same
+    SpreadTask* t = arg;
+    size_t a = (size_t)start * MATMUL_ROWS, b = (size_t)end * MATMUL_ROWS < (size_t)t->d ? (size_t)end * MATMUL_ROWS : (size_t)t->d;
+    memcpy(t->dst + a * t->row_bytes, t->src + a * t->row_bytes, (b - a) * t->row_bytes);
+    if (t->row_scales) { memcpy(t->dst_s + a * t->row_scales, t->src_s + a * t->row_scales, (b - a) * t->row_scales * sizeof(float)); }
+}
+
+static void spread_tensor(QuantizedTensor* t, char* dst, float* dst_s, int cols) {
+    SpreadTask task = { dst, t->q, dst_s, t->s, values_bytes(t->type, cols),
+                        is_quantized(t->type) ? cols / t->gs : 0, (int)(t->n / cols) };
+    pool_run(spread_task, &task, (task.d + MATMUL_ROWS - 1) / MATMUL_ROWS);
+}
+
+void numa_spread_weights(TransformerWeights* w, Config* p, int huge) {
+    // copy the weights into fresh memory, each matrix row block written by the thread that computes it.
+    // every node ends up holding the slice of every matrix its threads read, so matmuls only stream
+    // local memory. the rmsnorm weights are small and stay on the first node
+    if (pool.n_nodes < 2) { return; }
+    copy_weights(w, p, huge, spread_tensor);
+}
+#endif
+#endif
+
+static inline void parallel_for(void (*fn)(void*, int, int), void* ctx, int n) {
+    // fn(ctx, start, end) over the items [0, n): on the thread pool, with OpenMP/OpenACC, or serially
+#ifdef THREADS
+    pool_run(fn, ctx, n);
+#else
+    int i;
+    #ifdef ACCEL
+    ACCEL(i) // OMP/OACC Macro
+    #endif
+    for (i = 0; i < n; i++) {
+        fn(ctx, i, i + 1);
+    }
+#endif
+}
+
+#define WARMUP_CHUNK (1 << 20) // bytes a thread pages in at a time
+
+typedef struct {
+    const volatile char* base;
+    size_t bytes;
+} TouchTask;
+
+static void touch_task(void* arg, int start, int end) {
+    // read a byte of every page in the chunks [start, end)
+    TouchTask* t = arg;
+    size_t a = (size_t)start * WARMUP_CHUNK, b = (size_t)end * WARMUP_CHUNK < t->bytes ? (size_t)end * WARMUP_CHUNK : t->bytes;
+    for (size_t o = a; o < b; o += 4096) { (void)t->base[o]; }
+}
+
+void warmup_weights(TransformerWeights* w, Config* p, int mode) {
+    // page in a mapped checkpoint region by region, in the order forward() reads them, so the first
+    // tokens don't fault the weights in one page at a time in random order. WARMUP_ADVISE has the
+    // kernel read ahead in the background, WARMUP_TOUCH reads every page, with all threads, and
+    // returns once they are resident
+    int n = weight_regions(w, p, NULL);
+    WeightRegion* r = malloc(n * sizeof(WeightRegion));
+    if (!r) { fprintf(stderr, "malloc failed!\n"); exit(EXIT_FAILURE); }
+    weight_regions(w, p, r);
+    for (int i = 0; i < n; i++) {
+        if (r[i].bytes == 0) { continue; }
+        if (mode == WARMUP_TOUCH) {
+            TouchTask task = { *r[i].ptr, r[i].bytes };
+            parallel_for(touch_task, &task, (int)((r[i].bytes + WARMUP_CHUNK - 1) / WARMUP_CHUNK));
+        } else {
+#ifdef MADV_WILLNEED
+            char* start;
+            size_t len;
+            page_span(*r[i].ptr, r[i].bytes, &start, &len);
+            madvise(start, len, MADV_WILLNEED);
+#endif
+        }
+    }
+    free(r);
+}
+
+static inline void matmul_block(float* __restrict__ out, float* __restrict__ x, int8_t* __restrict__ xq, float* __restrict__ xs,
+                                QuantizedTensor* w, int n, int start, int end) {
+    // rows [start, end) of W (d,n) @ x (n,) into out[0 .. end-start), for any weight type.
+    // quantized types take x pre-quantized into xq/xs with the weight's group size.
+    // start is a multiple of MATMUL_ROWS, so repacked blocks start on a panel
+    size_t rb = values_bytes(w->type, n);
+    char* q = (char*)w->q + start * rb;
+    float* s = is_quantized(w->type) ? w->s + (size_t)start * n / w->gs : NULL;
+    int rows = end - start;
+    if (w->panel && rows % PANEL_ROWS == 0) {
+        if (w->type == WT_FP32) {
+            kernels.panels(out, x, (float*)q, n, 0, rows);
+        } else if (w->type == WT_F16) {
+            kernels.panels_f16(out, x, (uint16_t*)q, n, 0, rows);
+        } else if (w->type == WT_BF16) {
+            kernels.panels_bf16(out, x, (uint16_t*)q, n, 0, rows);
+        } else if (w->type == WT_Q8_0) {
+            kernels.panels_q80(out, xq, xs, (int8_t*)q, s, n, w->gs, 0, rows);
+        } else {
+            kernels.panels_q40(out, xq, xs, (uint8_t*)q, s, n, w->gs, 0, rows);
+        }
+        return;
+    }
+    // the partial panel at the end of a repacked W goes through the row kernels
+    char buf[w->panel ? rows * rb : 1];
+    if (w->panel) { unpanel_rows(buf, w, n, start, end); q = buf; }
+    if (w->type == WT_FP32) {
+        kernels.rows(out, x, (float*)q, n, 0, rows);
+    } else if (w->type == WT_F16) {
+        kernels.rows_f16(out, x, (uint16_t*)q, n, 0, rows);
+    } else if (w->type == WT_BF16) {
+        kernels.rows_bf16(out, x, (uint16_t*)q, n, 0, rows);
+    } else if (w->type == WT_Q8_0) {
+        kernels.rows_q80(out, xq, xs, (int8_t*)q, s, n, w->gs, 0, rows);
+    } else {
+        kernels.rows_q40(out, xq, xs, (uint8_t*)q, s, n, w->gs, 0, rows);
+    }
+}
+
+typedef struct {
+    // W (d,n) @ x for nb inputs x (n,), row j of the output starts at out + j*ldo.
+    // with w3 set, out = silu(W @ x) * (W3 @ x) instead
+    float* out;
+    int ldo;
+    float* x;
+    int8_t* xq; // x quantized with the weight's group size, quantized types only
+    float* xs;
+    QuantizedTensor* w;
+    QuantizedTensor* w3;
+    int nb, n, d;
+} MatmulTask;
+
+static void matmul_task(void* arg, int start, int end) {
+    // the blocks of MATMUL_ROWS rows [start, end). a block of weight rows stays in cache
+    // while every input of the batch uses it
+    MatmulTask* t = arg;
+    int quantized = is_quantized(t->w->type);
+    for (int blk = start; blk < end; blk++) {
+        int b = blk * MATMUL_ROWS;
+        int e = b + MATMUL_ROWS < t->d ? b + MATMUL_ROWS : t->d;
+        for (int j = 0; j < t->nb; j++) {
+            float* x = t->x + (size_t)j * t->n;
+            int8_t* xq = t->xq + (quantized ? (size_t)j * t->n : 0);
+            float* xs = t->xs + (quantized ? (size_t)j * t->n / t->w->gs : 0);
+            float* out = t->out + (size_t)j * t->ldo + b;
+            if (!t->w3) {
+                matmul_block(out, x, xq, xs, t->w, t->n, b, e);
+                continue;
+            }
+            // the SiLU gate is applied while w1(x) and w3(x) are still in registers
+            float gate[MATMUL_ROWS], up[MATMUL_ROWS];
+            matmul_block(gate, x, xq, xs, t->w, t->n, b, e);
+            matmul_block(up, x, xq, xs, t->w3, t->n, b, e);
+            for (int i = 0; i < e - b; i++) {
+                // F.silu; silu(x)=x*σ(x),where σ(x) is the logistic sigmoid
+                out[i] = gate[i] * (1.0f / (1.0f + expf(-gate[i]))) * up[i];
+            }
+        }
+    }
+}
+
+static inline void matmul(float* __restrict__ xout, float* __restrict__ x, QuantizedTensor* wt, int n, int d) {
+    // W (d,n) @ x (n,) -> xout (d,)
+    // by far the most amount of time is spent inside this little function
+    #ifdef BLAS
+    if (wt->type == WT_FP32) {
+        cblas_sgemv(CblasRowMajor, CblasNoTrans, d, n, 1.0f, wt->q, n, x, 1, 0.0f, xout, 1);
+        return;
+    }
+    #endif
+    // quantized weights: x is quantized to int8 once with the same group size, so the
+    // kernels' inner loop is an integer dot product rescaled once per group
+    int quantized = is_quantized(wt->type);
+    int8_t xq[quantized ? n : 1];
+    float xs[quantized ? n / wt->gs : 1];
+    if (quantized) { quantize(xq, xs, x, n, wt->gs); }
+    MatmulTask task = { xout, d, x, xq, xs, wt, NULL, 1, n, d };
+    parallel_for(matmul_task, &task, (d + MATMUL_ROWS - 1) / MATMUL_ROWS);
+}
+
+static inline void matmul_ffn(float* __restrict__ hb, float* __restrict__ hb2, float* __restrict__ x,
+                              QuantizedTensor* w1, QuantizedTensor* w3, int n, int d) {
+    // hb (d,) = silu(W1 @ x) * (W3 @ x), with W1, W3 (d,n)
+    // every block of rows reads w1 and w3 back to back and applies the SiLU gate while the
+    // results are still in registers: one parallel region, and w3(x) never goes through memory.
+    // hb2 (d,) is only used as scratch by BLAS builds
+    #ifdef BLAS
+    if (w1->type == WT_FP32) {
+        cblas_sgemv(CblasRowMajor, CblasNoTrans, d, n, 1.0f, w1->q, n, x, 1, 0.0f, hb, 1);
+        cblas_sgemv(CblasRowMajor, CblasNoTrans, d, n, 1.0f, w3->q, n, x, 1, 0.0f, hb2, 1);
+        for (int i = 0; i < d; i++) {
+            hb[i] = hb[i] * (1.0f / (1.0f + expf(-hb[i]))) * hb2[i];
+        }
+        return;
+    }
+    #else
+    (void)hb2; // the fused kernels need no scratch
+    #endif
+    int quantized = is_quantized(w1->type);
+    int8_t xq[quantized ? n : 1];
+    float xs[quantized ? n / w1->gs : 1];
+    if (quantized) { quantize(xq, xs, x, n, w1->gs); }
+    MatmulTask task = { hb, d, x, xq, xs, w1, w3, 1, n, d };
+    parallel_for(matmul_task, &task, (d + MATMUL_ROWS - 1) / MATMUL_ROWS);
+}
+
+static inline void rope(float* __restrict__ q, float* __restrict__ k, float* __restrict__ cs, int dim, int kv_dim, int head_size) {
+    // complex-valued rotate q (dim,) and k (kv_dim,) in each head, cs is the position's row of the rope table
+    for (int h = 0; h < dim; h += head_size) {
+        for (int i = 0; i < head_size; i+=2) {
+            float fcr = cs[i];
+            float fci = cs[i+1];
+            float v0 = q[h+i];
+            float v1 = q[h+i+1];
+            q[h+i]   = v0 * fcr - v1 * fci;
+            q[h+i+1] = v0 * fci + v1 * fcr;
+            if (h < kv_dim) {
+                v0 = k[h+i];
+                v1 = k[h+i+1];
+                k[h+i]   = v0 * fcr - v1 * fci;
+                k[h+i+1] = v0 * fci + v1 * fcr;
+            }
+        }
+    }
+}
+
+static inline uint16_t fp32_to_half(float f) {
+    // narrow to fp16, rounding to nearest even. too large becomes inf, too small an fp16 subnormal
+    uint32_t x;
+    memcpy(&x, &f, sizeof(x));
+    uint32_t sign = (x >> 16) & 0x8000, a = x & 0x7fffffff;
+    if (a >= 0x7f800000) { return sign | 0x7c00 | (a > 0x7f800000 ? 0x200 : 0); } // inf / nan
+    if (a >= 0x477ff000) { return sign | 0x7c00; } // rounds past 65504
+    if (a < 0x38800000) {
+        // below 2^-14: a multiple of the fp16 subnormal step 2^-24
+        float af;
+        memcpy(&af, &a, sizeof(af));
+        return sign | (uint16_t)lrintf(af * 16777216.0f);
+    }
+    // rebias 127 -> 15 and round the mantissa at bit 13
+    return sign | (uint16_t)((a + 0xfff + ((a >> 13) & 1) - 0x38000000) >> 13);
+}
+
+static inline float half_to_fp32_kv(uint16_t h) {
+    // widen fp16 without branches, so the attention loops vectorize: the float multiply rebiases
+    // the exponent, and turns subnormals into normals (flushed to zero by -Ofast builds, which is
+    // below anything that matters in the kv cache)
+    uint32_t bits = (uint32_t)(h & 0x7fff) << 13;
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+    f *= 0x1p112f;
+    memcpy(&bits, &f, sizeof(bits));
+    if ((h & 0x7c00) == 0x7c00) { bits |= 0x7f800000; } // inf / nan
+    bits |= (uint32_t)(h & 0x8000) << 16;
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+typedef struct {
+    // one layer of one kv cache page, at kv head kvh: rows are kv_dim values (scales n_kv_heads) apart
+    void* k;
+    void* v;
+    float* ks; // KV_Q8 only
+    float* vs;
+} KVSlice;
+
+static inline KVSlice kv_slice(KVCache* c, char* page, int l, int kvh) {
+    int n_kv_heads = c->kv_dim / c->head_size;
+    char* base = page + l * c->layer_bytes;
+    size_t hoff = (size_t)kvh * c->head_size * kv_type_bytes(c->type);
+    float* scales = (float*)(base + 2 * c->rows_bytes);
+    KVSlice sl = { base + hoff, base + c->rows_bytes + hoff, scales + kvh, scales + KV_PAGE * n_kv_heads + kvh };
+    return sl;
+}
+
+static inline int kv_slot(KVCache* c, int pos) {
+    // the cache row of position pos, and the RoPE position its key is rotated for. streaming keeps the
+    // first n_sink positions (the attention sinks) and the last window ones, which wrap around a ring
+    if (!c->window || pos < c->n_sink) { return pos; }
+    return c->n_sink + (pos - c->n_sink) % c->window;
+}
+
+static inline void rope_head(float* __restrict__ out, float* __restrict__ q, float* __restrict__ cs, int head_size) {
+    // out = q of one head rotated further by the rope table row cs
+    for (int i = 0; i < head_size; i += 2) {
+        out[i]   = q[i] * cs[i] - q[i+1] * cs[i+1];
+        out[i+1] = q[i] * cs[i+1] + q[i+1] * cs[i];
+    }
+}
+
+static inline void kv_store(KVCache* c, int l, int pos, float* __restrict__ k, float* __restrict__ v) {
+    // write the keys and values (kv_dim,) of one timestep into the cache row (l, kv_slot(pos)), allocating its page
+    int slot = kv_slot(c, pos);
+    KVSlice sl = kv_slice(c, kv_alloc_page(c, slot / KV_PAGE), l, 0);
+    int r = slot % KV_PAGE;
+    size_t off = (size_t)r * c->kv_dim;
+    if (c->type == KV_FP32) {
+        memcpy((float*)sl.k + off, k, c->kv_dim * sizeof(float));
+        memcpy((float*)sl.v + off, v, c->kv_dim * sizeof(float));
+    } else if (c->type == KV_FP16) {
+        uint16_t* kh = (uint16_t*)sl.k + off;
+        uint16_t* vh = (uint16_t*)sl.v + off;
+        for (int i = 0; i < c->kv_dim; i++) {
+            kh[i] = fp32_to_half(k[i]);
+            vh[i] = fp32_to_half(v[i]);
+        }
+    } else {
+        // symmetric int8, one group per kv head: the scale is the head's max |x| / 127
+        int n_kv_heads = c->kv_dim / c->head_size;
+        quantize((int8_t*)sl.k + off, sl.ks + r * n_kv_heads, k, c->kv_dim, c->head_size);
+        quantize((int8_t*)sl.v + off, sl.vs + r * n_kv_heads, v, c->kv_dim, c->head_size);
+    }
+}
+
+static inline void attention(float* __restrict__ xb, float* __restrict__ q, float* __restrict__ att,
+                             KVCache* c, float* rope_table, int l, int kvh, int pos) {
+    // one head attending over timesteps 0..pos: xb (head_size,) = softmax(q . k_t / sqrt(head_size)) @ v_t
+    // with k_t and v_t the slice of kv head kvh in the cache rows of layer l, walked page by page through
+    // the page table. quantized caches are consumed as stored: fp16 is widened in the loops, int8 takes
+    // the row's scale once per dot product
+    int head_size = c->head_size, kv_dim = c->kv_dim, n_kv_heads = kv_dim / head_size;
+    // the slots filled: 0..pos, or all of them once a streaming cache is full
+    int cur = kv_slot(c, pos);
+    int full = c->window && pos >= c->n_sink + c->window;
+    int slots = full ? c->n_sink + c->window : pos + 1;
+    // q is rotated for its slot cur. a full streaming cache is attended in cache order (sinks, then the
+    // ring from its oldest slot), so for RoPE the query sits at n_sink + window - 1: the sinks see q rotated
+    // that much further, the ring slots past cur (older positions, written before the ring wrapped) see it
+    // rotated a whole window further. the ring slots up to cur are already pos - their position apart
+    float qrot[full ? 2 * head_size : 1];
+    float* qsink = q;
+    float* qold = q;
+    if (full) {
+        qsink = qrot;
+        qold = qrot + head_size;
+        rope_head(qsink, q, rope_table + (c->n_sink + c->window - 1 - cur) * head_size, head_size);
+        rope_head(qold, q, rope_table + c->window * head_size, head_size);
+    }
+    // iterate over all timesteps, including the current one
+    for (int t0 = 0; t0 < slots; t0 += KV_PAGE) {
+        int n = slots - t0 < KV_PAGE ? slots - t0 : KV_PAGE; // timesteps of this page
+        KVSlice sl = kv_slice(c, c->pages[t0 / KV_PAGE], l, kvh);
+        float* a = att + t0;
+        if (c->type == KV_FP32) {
+            for (int t = 0; t < n; t++) {
+                // get the key vector for this head and at this timestep, and the query rotated for it
+                float* k = (float*)sl.k + t * kv_dim;
+                float* qt = t0 + t < c->n_sink ? qsink : t0 + t > cur ? qold : q;
                 // calculate the attention score as the dot product of q and k
                 float score = 0.0f;
 #ifdef BLAS
-                score = cblas_sdot(head_size, q, 1, k, 1);
+                score = cblas_sdot(head_size, qt, 1, k, 1);
 #else
                 for (int i = 0; i < head_size; i++) {
-                    score += q[i] * k[i];
+                    score += qt[i] * k[i];
                 }
 #endif
                 score /= sqrtf(head_size);
                 // save the score to the attention buffer
-                att[t] = score;
+                a[t] = score;
             }
+        } else if (c->type == KV_FP16) {
+            for (int t = 0; t < n; t++) {
+                uint16_t* k = (uint16_t*)sl.k + t * kv_dim;
+                float* qt = t0 + t < c->n_sink ? qsink : t0 + t > cur ? qold : q;
+                float score = 0.0f;
+                for (int i = 0; i < head_size; i++) {
+                    score += qt[i] * half_to_fp32_kv(k[i]);
+                }
+                a[t] = score / sqrtf(head_size);
+            }
+        } else {
+            for (int t = 0; t < n; t++) {
+                int8_t* k = (int8_t*)sl.k + t * kv_dim;
+                float* qt = t0 + t < c->n_sink ? qsink : t0 + t > cur ? qold : q;
+                float score = 0.0f;
+                for (int i = 0; i < head_size; i++) {
+                    score += qt[i] * k[i];
+                }
+                a[t] = score * sl.ks[t * n_kv_heads] / sqrtf(head_size);
+            }
+        }
+    }
 
-            // softmax the scores to get attention weights, from 0..pos inclusively
-            softmax(att, pos + 1);
-
-            // weighted sum of the values, store back into xb
-            float* xb = s->xb + h * head_size;
-            memset(xb, 0, head_size * sizeof(float));
-            for (int t = 0; t <= pos; t++) {
+    // softmax the scores to get attention weights, over all filled slots
+    softmax(att, slots);
+
+    // weighted sum of the values, store back into xb
+    memset(xb, 0, head_size * sizeof(float));
+    for (int t0 = 0; t0 < slots; t0 += KV_PAGE) {
+        int n = slots - t0 < KV_PAGE ? slots - t0 : KV_PAGE;
+        KVSlice sl = kv_slice(c, c->pages[t0 / KV_PAGE], l, kvh);
+        float* a = att + t0;
+        if (c->type == KV_FP32) {
+            for (int t = 0; t < n; t++) {
                 // get the value vector for this head and at this timestep
-                float* v = s->value_cache + loff + t * kv_dim + (h / kv_mul) * head_size;
+                float* v = (float*)sl.v + t * kv_dim;
                 // get the attention weight for this timestep
-                float a = att[t];
+                float w = a[t];
                 // accumulate the weighted value into xb
                 for (int i = 0; i < head_size; i++) {
-                    xb[i] += a * v[i];
+                    xb[i] += w * v[i];
                 }
             }
+        } else if (c->type == KV_FP16) {
+            for (int t = 0; t < n; t++) {
+                uint16_t* v = (uint16_t*)sl.v + t * kv_dim;
+                float w = a[t];
+                for (int i = 0; i < head_size; i++) {
+                    xb[i] += w * half_to_fp32_kv(v[i]);
+                }
+            }
+        } else {
+            for (int t = 0; t < n; t++) {
+                int8_t* v = (int8_t*)sl.v + t * kv_dim;
+                float w = a[t] * sl.vs[t * n_kv_heads]; // the scale folds into the weight
+                for (int i = 0; i < head_size; i++) {
+                    xb[i] += w * v[i];
+                }
+            }
+        }
+    }
+}
+
+typedef struct {
+    // nb rows, row j at position pos[j] of the sequence with kv cache kv[j], attending over that cache
+    // up to and including itself. row j's query and output are q + j*qstride and xb + j*xstride
+    float* xb;
+    float* q;
+    int xstride, qstride;
+    float* att;
+    KVCache** kv;
+    int* pos;
+    float* rope; // the rope table
+    int layer;
+    int nb, kv_mul, head_size, seq_len;
+} AttentionTask;
+
+static void attention_task(void* arg, int start, int end) {
+    // heads [start, end)
+    AttentionTask* t = arg;
+    for (int h = start; h < end; h++) {
+        // this head's query and output, its scores, and the kv cache of its kv head
+        for (int j = 0; j < t->nb; j++) {
+            attention(t->xb + j * t->xstride + h * t->head_size, t->q + j * t->qstride + h * t->head_size,
+                      t->att + h * t->seq_len, t->kv[j], t->rope, t->layer, h / t->kv_mul, t->pos[j]);
+        }
+    }
+}
+
+//float* forward(Transformer* transformer, int token, int pos) {
+__attribute__((always_inline))
+static inline float* forward(int token, int pos, Config *__restrict__ p, TransformerWeights *__restrict__ w, RunState *__restrict__ s) {
+
+    // a few convenience variables
+    //Config* p = &transformer->config;
+    //TransformerWeights* w = &transformer->weights;
+    //RunState* s = &transformer->state;
+    float *x = s->x;
+    int dim = p->dim;
+    int kv_dim = (p->dim * p->n_kv_heads) / p->n_heads;
+    int kv_mul = p->n_heads / p->n_kv_heads; // integer multiplier of the kv sharing in multiquery
+    int hidden_dim =  p->hidden_dim;
+    int head_size = dim / p->n_heads;
+    
+    // copy the token embedding into x
+    dequantize_row(x, w->token_embedding_table, token, dim);
+
+    for(unsigned long long l = 0; l < p->n_layers; l++) {
+
+        // attention rmsnorm
+        rmsnorm(s->xb, x, w->rms_att_weight + l*dim, dim);
+
+        // qkv matmuls for this position
+        if (w->wqkv) {
+            matmul(s->q, s->xb, w->wqkv + l, dim, dim + 2 * kv_dim); // writes q, k and v
+        } else {
+            matmul(s->q, s->xb, w->wq + l, dim, dim);
+            matmul(s->k, s->xb, w->wk + l, dim, kv_dim);
+            matmul(s->v, s->xb, w->wv + l, dim, kv_dim);
         }
 
+        // RoPE relative positional encoding: complex-valued rotate q and k in each head
+        rope(s->q, s->k, s->rope + kv_slot(&s->kv, pos) * head_size, dim, kv_dim, head_size);
+
+        // save key,value at this time step (pos) to our kv cache
+        kv_store(&s->kv, l, pos, s->k, s->v);
+
+        // multihead attention. iterate over all heads
+        KVCache* kv = &s->kv;
+        AttentionTask att = { s->xb, s->q, dim, dim, s->att, &kv, &pos, s->rope, l, 1, kv_mul, head_size, p->seq_len };
+        parallel_for(attention_task, &att, p->n_heads);
+
         // final matmul to get the output of the attention
-        matmul(s->xb2, s->xb, w->wo + l*dim*dim, dim, dim);
+        matmul(s->xb2, s->xb, w->wo + l, dim, dim);
 
         // residual connection back into x
         for (int i = 0; i < dim; i++) {
             x[i] += s->xb2[i];
         }
 
-        // ffn rmsnorm
-        rmsnorm(s->xb, x, w->rms_ffn_weight + l*dim, dim);
+        // ffn rmsnorm
+        rmsnorm(s->xb, x, w->rms_ffn_weight + l*dim, dim);
+
+        // Now for FFN in PyTorch we have: self.w2(F.silu(self.w1(x)) * self.w3(x))
+        // w1(x) and w3(x) are computed together and gated in one pass
+        matmul_ffn(s->hb, s->hb2, s->xb, w->w1 + l, w->w3 + l, dim, hidden_dim);
+
+        // final matmul to get the output of the ffn
+        matmul(s->xb, s->hb, w->w2 + l, hidden_dim, dim);
+
+        // residual connection
+        for (int i = 0; i < dim; i++) {
+            x[i] += s->xb[i];
+        }
+    }
+
+    // final rmsnorm
+    rmsnorm(x, x, w->rms_final_weight, dim);
+
+    // classifier into logits
+    matmul(s->logits, x, w->wcls, p->dim, p->vocab_size);
+    return s->logits;
+}
+
+// ----------------------------------------------------------------------------
+// prompt prefill: a block of positions at a time, so every weight is streamed from memory
+// once per block instead of once per token
+
+static void matmul_batch(float* __restrict__ xout, int ldo, float* __restrict__ x, QuantizedTensor* wt, int nb, int n, int d) {
+    // W (d,n) @ x (nb,n) -> xout (nb,d), row j of xout starts at xout + j*ldo
+    #ifdef BLAS
+    if (wt->type == WT_FP32) {
+        cblas_sgemm(CblasRowMajor, CblasNoTrans, CblasTrans, nb, d, n, 1.0f, x, n, wt->q, n, 0.0f, xout, ldo);
+        return;
+    }
+    #endif
+    int quantized = is_quantized(wt->type);
+    int8_t xq[quantized ? nb * n : 1];
+    float xs[quantized ? nb * n / wt->gs : 1];
+    if (quantized) {
+        for (int j = 0; j < nb; j++) { quantize(xq + j * n, xs + j * n / wt->gs, x + j * n, n, wt->gs); }
+    }
+    MatmulTask task = { xout, ldo, x, xq, xs, wt, NULL, nb, n, d };
+    parallel_for(matmul_task, &task, (d + MATMUL_ROWS - 1) / MATMUL_ROWS);
+}
+
+static void matmul_ffn_batch(float* __restrict__ hb, float* __restrict__ hb2, float* __restrict__ x,
+                             QuantizedTensor* w1, QuantizedTensor* w3, int nb, int n, int d) {
+    // hb (nb,d) = silu(x @ W1^T) * (x @ W3^T) for x (nb,n), see matmul_ffn()
+    #ifdef BLAS
+    if (w1->type == WT_FP32) {
+        matmul_batch(hb, d, x, w1, nb, n, d);
+        matmul_batch(hb2, d, x, w3, nb, n, d);
+        for (int i = 0; i < nb * d; i++) {
+            hb[i] = hb[i] * (1.0f / (1.0f + expf(-hb[i]))) * hb2[i];
+        }
+        return;
+    }
+    #else
+    (void)hb2; // the fused kernels need no scratch
+    #endif
+    int quantized = is_quantized(w1->type);
+    int8_t xq[quantized ? nb * n : 1];
+    float xs[quantized ? nb * n / w1->gs : 1];
+    if (quantized) {
+        for (int j = 0; j < nb; j++) { quantize(xq + j * n, xs + j * n / w1->gs, x + j * n, n, w1->gs); }
+    }
+    MatmulTask task = { hb, d, x, xq, xs, w1, w3, nb, n, d };
+    parallel_for(matmul_task, &task, (d + MATMUL_ROWS - 1) / MATMUL_ROWS);
+}
+
+static void forward_rows(int* tokens, KVCache** kv, int* pos, int nb, Config* p, TransformerWeights* w, RunState* s) {
+    // forward() for nb rows at once, nb <= PREFILL_BATCH: row j is tokens[j] at position pos[j] of the
+    // sequence with kv cache kv[j]. rows of one sequence come in position order, and may not wrap the
+    // ring of a streaming cache (see kv_chunk). fills the kv caches and leaves the final hidden state
+    // of every row in s->px. the activations are s's, its own kv cache is only used if it is in kv
+    int dim = p->dim;
+    int kv_dim = (p->dim * p->n_kv_heads) / p->n_heads;
+    int kv_mul = p->n_heads / p->n_kv_heads;
+    int hidden_dim = p->hidden_dim;
+    int head_size = dim / p->n_heads;
+    int qkv_dim = dim + 2 * kv_dim;
+
+    for (int j = 0; j < nb; j++) {
+        dequantize_row(s->px + j * dim, w->token_embedding_table, tokens[j], dim);
+    }
+
+    for(unsigned long long l = 0; l < (unsigned long long)p->n_layers; l++) {
+
+        // attention rmsnorm
+        for (int j = 0; j < nb; j++) {
+            rmsnorm(s->pxb + j * dim, s->px + j * dim, w->rms_att_weight + l*dim, dim);
+        }
+
+        // qkv matmuls for all rows, row j of pqkv is q, k and v of row j
+        if (w->wqkv) {
+            matmul_batch(s->pqkv, qkv_dim, s->pxb, w->wqkv + l, nb, dim, qkv_dim);
+        } else {
+            matmul_batch(s->pqkv, qkv_dim, s->pxb, w->wq + l, nb, dim, dim);
+            matmul_batch(s->pqkv + dim, qkv_dim, s->pxb, w->wk + l, nb, dim, kv_dim);
+            matmul_batch(s->pqkv + dim + kv_dim, qkv_dim, s->pxb, w->wv + l, nb, dim, kv_dim);
+        }
+
+        // RoPE, then save key,value of every row to its kv cache
+        for (int j = 0; j < nb; j++) {
+            float* q = s->pqkv + j * qkv_dim;
+            rope(q, q + dim, s->rope + kv_slot(kv[j], pos[j]) * head_size, dim, kv_dim, head_size);
+            kv_store(kv[j], l, pos[j], q + dim, q + dim + kv_dim);
+        }
+
+        // causal multihead attention: row j sees its cache up to and including itself
+        AttentionTask att = { s->pxb, s->pqkv, dim, qkv_dim, s->att, kv, pos, s->rope, l, nb, kv_mul, head_size, p->seq_len };
+        parallel_for(attention_task, &att, p->n_heads);
+
+        // output of the attention and residual connection
+        matmul_batch(s->pxb2, dim, s->pxb, w->wo + l, nb, dim, dim);
+        for (int i = 0; i < nb * dim; i++) {
+            s->px[i] += s->pxb2[i];
+        }
+
+        // ffn rmsnorm, gated w1/w3, w2 and residual connection
+        for (int j = 0; j < nb; j++) {
+            rmsnorm(s->pxb + j * dim, s->px + j * dim, w->rms_ffn_weight + l*dim, dim);
+        }
+        matmul_ffn_batch(s->phb, s->phb2, s->pxb, w->w1 + l, w->w3 + l, nb, dim, hidden_dim);
+        matmul_batch(s->pxb, dim, s->phb, w->w2 + l, nb, hidden_dim, dim);
+        for (int i = 0; i < nb * dim; i++) {
+            s->px[i] += s->pxb[i];
+        }
+    }
+}
+
+static void forward_block(int* tokens, int nb, int start_pos, Config* p, TransformerWeights* w, RunState* s) {
+    // forward() for positions start_pos .. start_pos+nb-1 of s's own sequence at once
+    KVCache* kv[PREFILL_BATCH];
+    int pos[PREFILL_BATCH];
+    for (int j = 0; j < nb; j++) {
+        kv[j] = &s->kv;
+        pos[j] = start_pos + j;
+    }
+    forward_rows(tokens, kv, pos, nb, p, w, s);
+}
+
+static inline int kv_chunk(KVCache* c, int pos, int n) {
+    // how many of n positions from pos on one block can take: a block must not wrap the ring of a
+    // streaming cache, its first positions would attend to the slots its last ones overwrote. once
+    // the cache is full, that means one position at a time
+    if (!c->window) { return n; }
+    int room = c->n_sink + c->window - pos;
+    return room <= 0 ? 1 : n < room ? n : room;
+}
+
+float* forward_batch(int* tokens, int n, int start_pos, Config* p, TransformerWeights* w, RunState* s) {
+    // forward tokens[0..n) at positions start_pos.. as a prompt prefill, n > 0.
+    // same kv cache and logits as n calls to forward(), but the matmuls become matrix-matrix
+    // products, so prefill is bound by compute instead of by streaming the weights.
+    // only the logits of the last position are computed, and returned
+    for (int i = 0, nb; i < n; i += nb) {
+        nb = kv_chunk(&s->kv, start_pos + i, n - i < PREFILL_BATCH ? n - i : PREFILL_BATCH);
+        forward_block(tokens + i, nb, start_pos + i, p, w, s);
+        if (i + nb == n) {
+            // final rmsnorm and classifier, for the last position only
+            rmsnorm(s->x, s->px + (nb - 1) * p->dim, w->rms_final_weight, p->dim);
+        }
+    }
+    matmul(s->logits, s->x, w->wcls, p->dim, p->vocab_size);
+    return s->logits;
+}
+
+// ----------------------------------------------------------------------------
+// batched decode: sequences with their own kv caches advance together, so a step streams the
+// weights once for all of them and the matmuls become (rows, dim) products. sequences join and
+// leave between steps, and the prompts of new ones are prefilled in chunks next to the decode rows
+
+typedef struct {
+    KVCache kv;
+    int pos;         // positions in the kv cache, the next pending token goes in here
+    int* pending;    // tokens to forward, owned by the caller: a prompt, then the token sampled last
+    int n_pending;
+    float* logits;   // after the step that forwarded the last pending token its logits, until the next step
+} Sequence;
+
+typedef struct {
+    Sequence* seqs[PREFILL_BATCH]; // a step has a row for each of them at most
+    int n;
+    float* logits;   // (PREFILL_BATCH, vocab_size)
+} Batch;
+
+void malloc_sequence(Sequence* q, Transformer* t) {
+    // an empty sequence with a kv cache laid out like t's
+    KVCache* c = &t->state.kv;
+    malloc_kv_cache(&q->kv, &t->config, c->type, c->huge);
+    q->kv.n_sink = c->n_sink;
+    q->kv.window = c->window;
+    q->kv.lock = c->lock;
+    q->kv.lock_failed = c->lock_failed;
+    q->pos = 0;
+    q->pending = NULL;
+    q->n_pending = 0;
+    q->logits = NULL;
+}
+
+void fork_sequence(Sequence* q, Sequence* src) {
+    // q continues from src's position, on src's kv pages until it writes to them. src stays out of
+    // the batch and is freed after q
+    kv_fork(&q->kv, &src->kv);
+    q->pos = src->pos;
+    q->pending = NULL;
+    q->n_pending = 0;
+    q->logits = NULL;
+}
+
+void reset_sequence(Sequence* q) {
+    // back to position 0, for the next request
+    kv_free_pages(&q->kv);
+    q->pos = 0;
+    q->n_pending = 0;
+    q->logits = NULL;
+}
 
-        // Now for FFN in PyTorch we have: self.w2(F.silu(self.w1(x)) * self.w3(x))
-        // first calculate self.w1(x) and self.w3(x)
-        matmul(s->hb, s->xb, w->w1 + l*dim*hidden_dim, dim, hidden_dim);
-        matmul(s->hb2, s->xb, w->w3 + l*dim*hidden_dim, dim, hidden_dim);
+void free_sequence(Sequence* q) {
+    free_kv_cache(&q->kv);
+}
 
-        // F.silu; silu(x)=x*σ(x),where σ(x) is the logistic sigmoid
-        for (int i = 0; i < hidden_dim; i++) {
-            s->hb[i] = s->hb[i] * (1.0f / (1.0f + expf(-s->hb[i])));
-        }
+void build_batch(Batch* b, Config* p) {
+    b->n = 0;
+    b->logits = malloc(PREFILL_BATCH * p->vocab_size * sizeof(float));
+    if (!b->logits) { fprintf(stderr, "malloc failed!\n"); exit(EXIT_FAILURE); }
+}
 
-        // elementwise multiply with w3(x)
-        for (int i = 0; i < hidden_dim; i++) {
-            s->hb[i] = s->hb[i] * s->hb2[i];
-        }
+void free_batch(Batch* b) {
+    free(b->logits);
+}
 
-        // final matmul to get the output of the ffn
-        matmul(s->xb, s->hb, w->w2 + l*dim*hidden_dim, hidden_dim, dim);
+int batch_join(Batch* b, Sequence* q) {
+    // q takes part from the next step on, 0 if the batch is full
+    if (b->n == PREFILL_BATCH) { return 0; }
+    b->seqs[b->n++] = q;
+    return 1;
+}
 
-        // residual connection
-        for (int i = 0; i < dim; i++) {
-            x[i] += s->xb[i];
+void batch_leave(Batch* b, Sequence* q) {
+    for (int i = 0; i < b->n; i++) {
+        if (b->seqs[i] == q) {
+            memmove(b->seqs + i, b->seqs + i + 1, (b->n - i - 1) * sizeof(Sequence*));
+            b->n--;
+            return;
         }
     }
+}
 
-    // final rmsnorm
-    rmsnorm(x, x, w->rms_final_weight, dim);
-
-    // classifier into logits
-    matmul(s->logits, x, w->wcls, p->dim, p->vocab_size);
-    return s->logits;
+int batch_step(Batch* b, Config* p, TransformerWeights* w, RunState* s) {
+    // one pass over the weights for up to PREFILL_BATCH rows: first one row for every decoding
+    // sequence (one pending token), then chunks of the pending prompts in join order with the rows
+    // left. a sequence whose last pending token went through gets its logits. the caller takes
+    // sequences out of the batch before they reach seq_len. returns the number of rows
+    int tokens[PREFILL_BATCH], pos[PREFILL_BATCH];
+    KVCache* kv[PREFILL_BATCH];
+    Sequence* last[PREFILL_BATCH]; // the sequence a row is the last pending token of, or NULL
+    int nb = 0;
+    for (int pass = 0; pass < 2; pass++) {
+        for (int i = 0; i < b->n && nb < PREFILL_BATCH; i++) {
+            Sequence* q = b->seqs[i];
+            if (pass == 0) { q->logits = NULL; }
+            if (q->n_pending == 0 || (pass == 0) != (q->n_pending == 1)) { continue; }
+            int m = kv_chunk(&q->kv, q->pos, q->n_pending < PREFILL_BATCH - nb ? q->n_pending : PREFILL_BATCH - nb);
+            for (int j = 0; j < m; j++, nb++) {
+                tokens[nb] = q->pending[j];
+                kv[nb] = &q->kv;
+                pos[nb] = q->pos + j;
+                last[nb] = j == q->n_pending - 1 ? q : NULL;
+            }
+            q->pending += m;
+            q->n_pending -= m;
+            q->pos += m;
+        }
+    }
+    if (nb == 0) { return 0; }
+    forward_rows(tokens, kv, pos, nb, p, w, s);
+
+    // final rmsnorm and classifier, for the rows that have their sequence's next token
+    int m = 0;
+    for (int j = 0; j < nb; j++) {
+        if (!last[j]) { continue; }
+        rmsnorm(s->pxb + m * p->dim, s->px + j * p->dim, w->rms_final_weight, p->dim);
+        last[j]->logits = b->logits + m * p->vocab_size;
+        m++;
+    }
+    if (m > 0) { matmul_batch(b->logits, p->vocab_size, s->pxb, w->wcls, m, p->dim, p->vocab_size); }
+    return nb;
 }
 
 // ----------------------------------------------------------------------------
 // The Byte Pair Encoding (BPE) Tokenizer that translates strings <-> tokens
 
+typedef struct {
+    char *str;
+    int id;
+} TokenIndex;
+
 typedef struct {
     char** vocab;
     float* vocab_scores;
+    TokenIndex *sorted_vocab; // sorted on the first encode() and kept for the next ones
     int vocab_size;
     unsigned int max_token_length;
     char byte_piece[2];
@@ -674,6 +3264,7 @@ void build_tokenizer(Tokenizer* t, char* tokenizer_path, int vocab_size) {
     t->vocab = (char**)malloc(vocab_size * sizeof(char*));
     t->vocab_scores = (float*)malloc(vocab_size * sizeof(float));
     t->byte_piece[1] = '\0'; // null terminate the byte_piece string
+    t->sorted_vocab = NULL; // initialized lazily
     // Parse the data from tokenizer_path
     char* token_data = tokenizer_path;
     int token_data_offset = 0;
@@ -707,6 +3298,7 @@ void build_tokenizer(Tokenizer* t, char* tokenizer_path, int vocab_size) {
     t->vocab = (char**)malloc(vocab_size * sizeof(char*));
     t->vocab_scores = (float*)malloc(vocab_size * sizeof(float));
     t->byte_piece[1] = '\0'; // null terminate the byte_piece string
+    t->sorted_vocab = NULL; // initialized lazily
     // read in the file
     FILE *file = fopen(tokenizer_path, "rb");
     if (!file) { fprintf(stderr, "couldn't load %s\n", tokenizer_path); exit(EXIT_FAILURE); }
@@ -727,6 +3319,7 @@ void free_tokenizer(Tokenizer* t) {
     for (int i = 0; i < t->vocab_size; i++) { free(t->vocab[i]); }
     free(t->vocab);
     free(t->vocab_scores);
+    free(t->sorted_vocab);
 }
 
 char* decode(Tokenizer* t, int prev_token, int token) {
@@ -746,11 +3339,6 @@ char* decode(Tokenizer* t, int prev_token, int token) {
     return piece;
 }
 
-typedef struct {
-    char *str;
-    int id;
-} TokenIndex;
-
 int compare_tokens(const void *a, const void *b) {
     return strcmp(((TokenIndex*)a)->str, ((TokenIndex*)b)->str);
 }
@@ -762,16 +3350,21 @@ int str_lookup(char *str, TokenIndex *sorted_vocab, int vocab_size) {
     return res != NULL ? res->id : -1;
 }
 
-void encode(Tokenizer* t, char *text, int *tokens, int *n_tokens) {
-    // encode the string text (input) into an upper-bound preallocated tokens[] array
-
-    // sort vocabulary
-    TokenIndex *sorted_vocab = malloc(t->vocab_size * sizeof(TokenIndex));
+void sort_vocab(Tokenizer* t) {
+    // sort vocabulary, once: a resident tokenizer encodes many prompts
+    if (t->sorted_vocab != NULL) { return; }
+    t->sorted_vocab = malloc(t->vocab_size * sizeof(TokenIndex));
     for (int i = 0; i < t->vocab_size; i++) {
-        sorted_vocab[i].str = t->vocab[i];
-        sorted_vocab[i].id = i;
+        t->sorted_vocab[i].str = t->vocab[i];
+        t->sorted_vocab[i].id = i;
     }
-    qsort(sorted_vocab, t->vocab_size, sizeof(TokenIndex), compare_tokens);
+    qsort(t->sorted_vocab, t->vocab_size, sizeof(TokenIndex), compare_tokens);
+}
+
+void encode(Tokenizer* t, char *text, int *tokens, int *n_tokens) {
+    // encode the string text (input) into an upper-bound preallocated tokens[] array
+    sort_vocab(t);
+    TokenIndex *sorted_vocab = t->sorted_vocab;
 
     // create a temporary buffer that will store merge candidates of always two consecutive tokens
     char* str_buffer = malloc((t->max_token_length*2 +1 +2) * sizeof(char)); // *2 for concat, +1 for null terminator +2 for UTF8 (in case max_token_lenght is 1)
@@ -862,12 +3455,11 @@ void encode(Tokenizer* t, char *text, int *tokens, int *n_tokens) {
     }
 
     free(str_buffer);
-    free(sorted_vocab);
 }
 
 // ----------------------------------------------------------------------------
 // The Sampler, which takes logits and returns a sampled token
-// sampling can be done in a few ways: greedy argmax, sampling, top-p sampling
+// sampling can be done in a few ways: greedy argmax, sampling, top-k, top-p and min-p sampling
 
 typedef struct {
     float prob;
@@ -876,21 +3468,21 @@ typedef struct {
 
 typedef struct {
     int vocab_size;
-    ProbIndex* probindex; // buffer used in top-p sampling
+    ProbIndex* probindex; // buffer used in top-k/top-p/min-p sampling
+    int topk;             // sample from the k most likely tokens, 0 = off
+    float minp;           // sample from the tokens at least minp times as likely as the most likely one, 0 = off
+    unsigned long long rng_state; // every sampler its own stream, so generations in one process don't share one
 } Sampler;
 
-// rng should technically be a state variable of the Sampler
-// leaving it global here for now for convenience, maybe move later
-unsigned long long rng_seed;
-unsigned int random_u32() {
+unsigned int random_u32(unsigned long long *state) {
     // xorshift rng: https://en.wikipedia.org/wiki/Xorshift#xorshift.2A
-    rng_seed ^= rng_seed >> 12;
-    rng_seed ^= rng_seed << 25;
-    rng_seed ^= rng_seed >> 27;
-    return (rng_seed * 0x2545F4914F6CDD1Dull) >> 32;
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return (*state * 0x2545F4914F6CDD1Dull) >> 32;
 }
-float random_f32() { // random float32 in [0,1)
-    return (random_u32() >> 8) / 16777216.0f;
+float random_f32(unsigned long long *state) { // random float32 in [0,1)
+    return (random_u32(state) >> 8) / 16777216.0f;
 }
 
 int sample_argmax(float* probabilities, int n) {
@@ -906,12 +3498,11 @@ int sample_argmax(float* probabilities, int n) {
     return max_i;
 }
 
-int sample_mult(float* probabilities, int n) {
-    // sample index from probabilities (they must sum to 1!)
-    float r = random_f32();
+int sample_mult(float* weights, int n, float r) {
+    // sample index from weights, r is uniform in [0, their sum)
     float cdf = 0.0f;
     for (int i = 0; i < n; i++) {
-        cdf += probabilities[i];
+        cdf += weights[i];
         if (r < cdf) {
             return i;
         }
@@ -927,38 +3518,115 @@ int compare(const void* a, const void* b) {
     return 0;
 }
 
-int sample_topp(float* probabilities, int n, float topp, ProbIndex* probindex) {
-    // top-p sampling (or "nucleus sampling") samples from the smallest set of
-    // tokens that exceed probability topp. This way we never sample tokens that
-    // have very low probabilities and are less likely to go "off the rails".
+#define SAMPLE_BUCKETS 128 // quarter octaves below the most likely token, the last one takes the rest
 
-    int n0 = 0;
-    // quicksort indices in descending order of probabilities
-    // values smaller than (1 - topp) / (n - 1) cannot be part of the result
-    // so for efficiency we crop these out as candidates before sorting
-    const float cutoff = (1.0f - topp) / (n - 1);
-    for (int i = 0; i < n; i++) {
-        if (probabilities[i] >= cutoff) {
-            probindex[n0].index = i;
-            probindex[n0].prob = probabilities[i];
-            n0++;
+static inline int prob_bucket(float p) {
+    // p in [0, 1], relative to the most likely token. positive floats order like their bits,
+    // so the distance to the bits of 1.0 shifted down to two mantissa bits counts quarter octaves
+    uint32_t bits;
+    memcpy(&bits, &p, sizeof(bits));
+    uint32_t b = (0x3f800000u - bits) >> 21;
+    return b < SAMPLE_BUCKETS - 1 ? (int)b : SAMPLE_BUCKETS - 1;
+}
+
+static inline float bucket_floor(int b) {
+    // the lowest probability of bucket b, 0 for the last one
+    if (b >= SAMPLE_BUCKETS - 1) { return 0.0f; }
+    uint32_t bits = 0x3f800000u - ((uint32_t)(b + 1) << 21) + 1;
+    float p;
+    memcpy(&p, &bits, sizeof(p));
+    return p;
+}
+
+int sample_filtered(Sampler* sampler, float* probabilities, float sum, int topk, float topp, float minp, float coin) {
+    // sample from the most likely tokens that top-k (the k most likely), top-p (or "nucleus", the
+    // fewest whose probability exceeds topp) and min-p (at least minp times the most likely) all keep.
+    // the probabilities are relative to the most likely token (1.0) and add up to sum.
+    // the three keep a run of the most likely tokens, so a histogram over quarter octaves finds the
+    // bucket that run ends in. the buckets above it are kept whole, in any order, and only the
+    // tokens of the last one are sorted to find where the run ends: typically a few dozen instead
+    // of the vocabulary. the histogram's sums may round differently than the walk below, which has
+    // the last word
+    int n = sampler->vocab_size;
+    ProbIndex* probindex = sampler->probindex;
+    float limit = topp > 0 && topp < 1 ? topp * sum : INFINITY;
+    int stop = minp > 0 ? prob_bucket(minp) : SAMPLE_BUCKETS - 1; // nothing below minp's bucket is kept
+    if (topk < n || limit < INFINITY) {
+        // four histograms side by side, most tokens fall into a few buckets and would wait on each other.
+        // top-k needs the counts, top-p the masses, only those are taken
+        int count[4][SAMPLE_BUCKETS] = { { 0 } };
+        float mass[4][SAMPLE_BUCKETS] = { { 0 } };
+        int i = 0;
+        if (limit == INFINITY) {
+            for (; i + 4 <= n; i += 4) {
+                for (int j = 0; j < 4; j++) { count[j][prob_bucket(probabilities[i + j])]++; }
+            }
+            for (; i < n; i++) { count[0][prob_bucket(probabilities[i])]++; }
+        } else if (topk == n) {
+            for (; i + 4 <= n; i += 4) {
+                for (int j = 0; j < 4; j++) { mass[j][prob_bucket(probabilities[i + j])] += probabilities[i + j]; }
+            }
+            for (; i < n; i++) { mass[0][prob_bucket(probabilities[i])] += probabilities[i]; }
+        } else {
+            for (; i + 4 <= n; i += 4) {
+                for (int j = 0; j < 4; j++) {
+                    int b = prob_bucket(probabilities[i + j]);
+                    count[j][b]++;
+                    mass[j][b] += probabilities[i + j];
+                }
+            }
+            for (; i < n; i++) {
+                int b = prob_bucket(probabilities[i]);
+                count[0][b]++;
+                mass[0][b] += probabilities[i];
+            }
+        }
+        int c = 0;
+        float m = 0.0f;
+        for (int b = 0; b < stop; b++) {
+            c += count[0][b] + count[1][b] + count[2][b] + count[3][b];
+            m += mass[0][b] + mass[1][b] + mass[2][b] + mass[3][b];
+            if (c >= topk || m > limit) { stop = b; break; }
+        }
+    }
+
+    // gather the candidates: the buckets above stop from the front, stop's own from the back.
+    // the most likely token is always one of them
+    float hi = stop > 0 ? bucket_floor(stop - 1) : INFINITY;
+    float lo = bucket_floor(stop) > minp ? bucket_floor(stop) : minp;
+    int n0 = 0, n1 = n;
+    for (int i = 0; i < n; i += 16) {
+        // candidates are rare, blocks without one are skipped by a compare the compiler vectorizes
+        int end = i + 16 < n ? i + 16 : n, any = 0;
+        for (int j = i; j < end; j++) { any |= probabilities[j] >= lo; }
+        if (!any) { continue; }
+        for (int j = i; j < end; j++) {
+            float p = probabilities[j];
+            if (p < lo) { continue; }
+            int k = p >= hi ? n0++ : --n1;
+            probindex[k].index = j;
+            probindex[k].prob = p;
         }
     }
-    qsort(probindex, n0, sizeof(ProbIndex), compare);
+    // stop's bucket follows the others, sorted
+    memmove(probindex + n0, probindex + n1, (n - n1) * sizeof(ProbIndex));
+    qsort(probindex + n0, n - n1, sizeof(ProbIndex), compare);
+    n0 += n - n1;
+    if (n0 > topk) { n0 = topk; }
 
     // truncate the list where cumulative probability exceeds topp
     float cumulative_prob = 0.0f;
     int last_idx = n0 - 1; // in case of rounding errors consider all elements
     for (int i = 0; i < n0; i++) {
         cumulative_prob += probindex[i].prob;
-        if (cumulative_prob > topp) {
+        if (cumulative_prob > limit) {
             last_idx = i;
             break; // we've exceeded topp by including last_idx
         }
     }
 
     // sample from the truncated list
-    float r = random_f32() * cumulative_prob;
+    float r = coin * cumulative_prob;
     float cdf = 0.0f;
     for (int i = 0; i <= last_idx; i++) {
         cdf += probindex[i].prob;
@@ -969,8 +3637,11 @@ int sample_topp(float* probabilities, int n, float topp, ProbIndex* probindex) {
     return probindex[last_idx].index; // in case of rounding errors
 }
 
-void build_sampler(Sampler* sampler, int vocab_size) {
+void build_sampler(Sampler* sampler, int vocab_size, unsigned long long rng_seed) {
     sampler->vocab_size = vocab_size;
+    sampler->rng_state = rng_seed;
+    sampler->topk = 0;
+    sampler->minp = 0.0f;
     // probindex might not be needed, but it's a ~small buffer so we'll just malloc it
     sampler->probindex = malloc(vocab_size * sizeof(ProbIndex));
 }
@@ -980,29 +3651,33 @@ void free_sampler(Sampler* sampler) {
 }
 
 int sample(Sampler* sampler, float* logits, float temperature, float topp) {
-    // sample the token given the logits and some hyperparameters
-    int next;
+    // sample the token given the logits and some hyperparameters. the logits are overwritten
+    int n = sampler->vocab_size;
     if (temperature == 0.0f) {
         // greedy argmax sampling: take the token with the highest probability
-        next = sample_argmax(logits, sampler->vocab_size);
-    } else {
-        // apply the temperature to the logits
-        for (int q=0; q<sampler->vocab_size; q++) { logits[q] /= temperature; }
-        // apply softmax to the logits to get the probabilities for next token
-        softmax(logits, sampler->vocab_size);
-        // we sample from this distribution to get the next token
-        if (topp <= 0 || topp >= 1) {
-            // simply sample from the predicted probability distribution
-            next = sample_mult(logits, sampler->vocab_size);
-        } else {
-            // top-p (nucleus) sampling, clamping the least likely tokens to zero
-            next = sample_topp(logits, sampler->vocab_size, topp, sampler->probindex);
-        }
+        return sample_argmax(logits, n);
+    }
+    // the softmax with the temperature folded in, in two passes: the max, then exp and sum together.
+    // the probabilities are left relative to the most likely token, the draws scale by the sum instead
+    float max = logits[0];
+    for (int i = 1; i < n; i++) { max = logits[i] > max ? logits[i] : max; }
+    float scale = 1.0f / temperature;
+    float sum = 0.0f;
+    for (int i = 0; i < n; i++) {
+        float e = expf((logits[i] - max) * scale);
+        logits[i] = e;
+        sum += e;
+    }
+    float coin = random_f32(&sampler->rng_state);
+    int topk = sampler->topk > 0 && sampler->topk < n ? sampler->topk : n;
+    if (topk == n && (topp <= 0 || topp >= 1) && sampler->minp <= 0) {
+        // simply sample from the predicted probability distribution
+        return sample_mult(logits, n, coin * sum);
     }
-    return next;
+    // top-k, top-p and min-p, clamping the least likely tokens to zero
+    return sample_filtered(sampler, logits, sum, topk, topp, sampler->minp, coin);
 }
 
-
 float loss(int token, int pos, Config* __restrict__ config, RunState* __restrict__ s, TransformerWeights* __restrict__ w, int nexttok, float temperature) {
     float* logits = forward(token, pos, config, w, s);
 
@@ -1036,6 +3711,654 @@ long time_in_ms() {
     return time.tv_sec * 1000 + time.tv_nsec / 1000000;
 }
 
+// ----------------------------------------------------------------------------
+// generation: the token loop of run and of libl2e
+
+// called with the text of each token generate() emits, pos is that token's position. prompt: an
+// echoed prompt token, else a sampled one, whose nonzero return stops the generation
+typedef int (*PieceFn)(const char* piece, int pos, int prompt, void* user);
+
+static int generate(Config* p, TransformerWeights* w, RunState* s, Tokenizer* tokenizer, Sampler* sampler,
+                    int* prompt_tokens, int num_prompt_tokens, int* pos, int* token, int steps,
+                    float temperature, float topp, int echo, PieceFn on_piece, void* user) {
+    // *token goes in at *pos (BOS, or a resumed session's next token), the prompt after it. then a token
+    // at a time is sampled until position steps, BOS or on_piece stops it. *pos and *token end as the next
+    // position and the token to forward there, what a session resumes from. echo: hand the prompt's
+    // pieces to on_piece too. returns the number of sampled tokens
+    int prompt_pos = *pos; // the prompt follows the token at this position
+    int cur = *token;
+    int next = cur; // will store the next token in the sequence
+    int at = *pos;
+
+    // prefill: the token and the prompt go through the model as one batch. the loop below then
+    // starts at the last position of the batch, with its logits already computed
+    float* logits = NULL;
+    if (num_prompt_tokens > 0 && steps - at > 1) {
+        int n = num_prompt_tokens + 1 < steps - at ? num_prompt_tokens + 1 : steps - at;
+        int* batch = malloc(n * sizeof(int));
+        batch[0] = cur;
+        memcpy(batch + 1, prompt_tokens, (n - 1) * sizeof(int));
+        logits = forward_batch(batch, n, at, p, w, s);
+        free(batch);
+        for (int i = 0; i < n - 1; i++) {
+            at++;
+            if (echo) { on_piece(decode(tokenizer, cur, prompt_tokens[i]), at, 1, user); }
+            cur = prompt_tokens[i];
+        }
+    }
+
+    int generated = 0;
+    while (at < steps) {
+        // forward the transformer to get logits for the next token
+        if (logits == NULL) { logits = forward(cur, at, p, w, s); }
+        // the prompt tokens the prefill did not take are forced, then the next token is sampled
+        int forced = at - prompt_pos < num_prompt_tokens;
+        next = forced ? prompt_tokens[at - prompt_pos] : sample(sampler, logits, temperature, topp);
+        logits = NULL;
+        at++;
+
+        // data-dependent terminating condition: the BOS (1) token delimits sequences
+        if (next == 1) { break; }
+
+        // the token as string, decoded with the Tokenizer object
+        char* piece = decode(tokenizer, cur, next);
+        cur = next;
+        if (forced) {
+            if (echo) { on_piece(piece, at, 1, user); }
+        } else {
+            generated++;
+            if (on_piece(piece, at, 0, user)) { break; }
+        }
+    }
+    *pos = at;
+    *token = next;
+    return generated;
+}
+
+// ----------------------------------------------------------------------------
+// batched generation: n samples of one prompt decoded together (-B), or forked from one prefill (-N)
+
+void generate_batch(Transformer* t, Tokenizer* tokenizer, Sampler* sampler, char* prompt, int steps,
+                    float temperature, float topp, int n, int fork, int stats) {
+    // every sequence gets its own rng, seeded one apart, and leaves the batch on BOS or at steps.
+    // fork: the prompt is prefilled once and the n sequences start from its kv pages and logits,
+    // the same samples as without, for a single prefill. the texts are printed once all are done
+    Config* p = &t->config;
+    int* prompt_tokens = malloc((strlen(prompt ? prompt : "") + 2) * sizeof(int));
+    int num_prompt_tokens = 0;
+    prompt_tokens[0] = 1; // BOS, then the prompt
+    if (prompt) { encode(tokenizer, prompt, prompt_tokens + 1, &num_prompt_tokens); }
+    Sequence* seqs = malloc(n * sizeof(Sequence));
+    unsigned long long* rng = malloc(n * sizeof(unsigned long long));
+    int* out = malloc((size_t)n * (steps + 1) * sizeof(int)); // the tokens of each sequence
+    int* n_out = calloc(n, sizeof(int));
+    int* next = malloc(n * sizeof(int));
+    Batch b;
+    build_batch(&b, p);
+    long start = time_in_ms();
+    long rows = 0, decoded = 0;
+    Sequence prefix; // fork: the prompt, whose kv pages the sequences share
+    float* fork_logits = NULL; // fork: the prompt's logits, one copy per sequence, sample() works in place
+    if (fork) {
+        malloc_sequence(&prefix, t);
+        prefix.pending = prompt_tokens;
+        prefix.n_pending = num_prompt_tokens + 1 < steps ? num_prompt_tokens + 1 : steps;
+        batch_join(&b, &prefix);
+        while (!prefix.logits) { rows += batch_step(&b, p, &t->weights, &t->state); }
+        batch_leave(&b, &prefix);
+        fork_logits = malloc((size_t)n * p->vocab_size * sizeof(float));
+        if (!fork_logits) { fprintf(stderr, "malloc failed!\n"); exit(EXIT_FAILURE); }
+    }
+    for (int i = 0; i < n; i++) {
+        malloc_sequence(&seqs[i], t);
+        if (fork) {
+            fork_sequence(&seqs[i], &prefix);
+            seqs[i].logits = fork_logits + (size_t)i * p->vocab_size;
+            memcpy(seqs[i].logits, prefix.logits, p->vocab_size * sizeof(float));
+        } else {
+            seqs[i].pending = prompt_tokens;
+            seqs[i].n_pending = num_prompt_tokens + 1 < steps ? num_prompt_tokens + 1 : steps;
+        }
+        rng[i] = sampler->rng_state + i;
+        batch_join(&b, &seqs[i]);
+    }
+    for (int forked = fork; b.n > 0; forked = 0) {
+        // forked sequences sample their first token from the prompt's logits, without a step
+        if (!forked) { rows += batch_step(&b, p, &t->weights, &t->state); }
+        for (int k = b.n - 1; k >= 0; k--) {
+            Sequence* q = b.seqs[k];
+            if (!q->logits) { continue; } // still prefilling
+            int i = q - seqs;
+            sampler->rng_state = rng[i];
+            next[i] = sample(sampler, q->logits, temperature, topp);
+            rng[i] = sampler->rng_state;
+            decoded++;
+            // data-dependent terminating condition: the BOS (1) token delimits sequences
+            if (next[i] == 1) { batch_leave(&b, q); continue; }
+            out[(size_t)i * (steps + 1) + n_out[i]++] = next[i];
+            if (q->pos >= steps) { batch_leave(&b, q); continue; }
+            q->pending = &next[i];
+            q->n_pending = 1;
+        }
+    }
+    long end = time_in_ms();
+
+    for (int i = 0; i < n; i++) {
+        printf("\n[%d] ", i);
+        int token = 1;
+        for (int j = 0; j < num_prompt_tokens && j < steps - 1; j++) {
+            printf("%s", decode(tokenizer, token, prompt_tokens[j + 1]));
+            token = prompt_tokens[j + 1];
+        }
+        for (int j = 0; j < n_out[i]; j++) {
+            printf("%s", decode(tokenizer, token, out[(size_t)i * (steps + 1) + j]));
+            token = out[(size_t)i * (steps + 1) + j];
+        }
+        printf("\n");
+    }
+    fflush(stdout);
+    if (stats && end > start) {
+        fprintf(stderr, "batch of %d: %ld rows forwarded, achieved tok/s: %f over all sequences\n", n, rows,
+                decoded / (double)(end - start) * 1000);
+    }
+    int copied = 0; // pages the sequences allocated or copied from the prompt's
+    for (int i = 0; i < n; i++) {
+        copied += seqs[i].kv.n_alloc;
+        free_sequence(&seqs[i]);
+    }
+    if (fork) {
+        if (stats) { fprintf(stderr, "kv cache: %d prompt pages shared by %d sequences, %d pages of their own\n", prefix.kv.n_alloc, n, copied); }
+        free_sequence(&prefix); // after the sequences that borrow its pages
+        free(fork_logits);
+    }
+    free_batch(&b);
+    free(prompt_tokens);
+    free(seqs);
+    free(rng);
+    free(out);
+    free(n_out);
+    free(next);
+}
+
+// ----------------------------------------------------------------------------
+// http server (--serve): completions streamed as server-sent events. one thread runs the network
+// and the batched decode in turns, so concurrent requests share every pass over the weights and
+// the model is loaded once for all of them
+
+#ifdef SERVER
+#define SERVE_CLIENTS 64        // connections open at once, PREFILL_BATCH of them decode together
+#define SERVE_REQUEST (1 << 16) // largest request, headers and body
+#define SERVE_BACKLOG (1 << 20) // bytes of events a client may fall behind by before it is dropped
+
+typedef struct {
+    int fd;                 // -1 = free slot
+    char* req;              // request bytes read so far
+    int len;
+    char* out;              // bytes not sent yet: sockets are non-blocking, poll() says when to go on
+    size_t out_len, out_cap;
+    int closing;            // answered, close once out is sent
+    int streaming;          // a completion is on its way
+    int joined;             // its sequence is in the batch
+    Sequence seq;
+    int* prompt_tokens;     // BOS, then the prompt
+    int next;               // sampled last, pending for the next step
+    int prev;               // decode() wants the token before
+    int steps, sent;
+    float temperature, topp, minp;
+    int topk;
+    unsigned long long rng;
+    long start;
+} Client;
+
+static int client_flush(Client* c) {
+    // send what the socket takes now, 0 if the client is gone
+    if (c->out_len == 0) { return 1; }
+    size_t done = 0;
+    while (done < c->out_len) {
+        ssize_t k = send(c->fd, c->out + done, c->out_len - done, 0);
+        if (k < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) { break; }
+        if (k < 0 && errno == EINTR) { continue; }
+        if (k <= 0) { return 0; }
+        done += k;
+    }
+    memmove(c->out, c->out + done, c->out_len - done);
+    c->out_len -= done;
+    return 1;
+}
+
+static int client_send(Client* c, const char* buf, size_t n) {
+    // queue n bytes and send what can go now. 0 if the client is gone, or so far behind that it is
+    // dropped: a client that stops reading must not hold up the others
+    if (c->out_len + n > SERVE_BACKLOG) { return 0; }
+    if (c->out_len + n > c->out_cap) {
+        size_t cap = c->out_cap ? c->out_cap : 4096;
+        while (cap < c->out_len + n) { cap *= 2; }
+        char* out = realloc(c->out, cap);
+        if (!out) { return 0; }
+        c->out = out;
+        c->out_cap = cap;
+    }
+    memcpy(c->out + c->out_len, buf, n);
+    c->out_len += n;
+    return client_flush(c);
+}
+
+static void send_status(Client* c, const char* status, const char* body) {
+    // answer with a plain text body, then close
+    char head[256];
+    snprintf(head, sizeof(head), "HTTP/1.1 %s\r\nContent-Type: text/plain\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n",
+             status, strlen(body));
+    if (client_send(c, head, strlen(head))) { client_send(c, body, strlen(body)); }
+    c->closing = 1;
+}
+
+static char* header_value(char* req, char* end, const char* name) {
+    // the value of header name in the request head [req, end), or NULL. names are case-insensitive
+    size_t n = strlen(name);
+    for (char* line = strstr(req, "\r\n"); line && line < end; line = strstr(line + 2, "\r\n")) {
+        if (strncasecmp(line + 2, name, n) == 0 && line[n + 2] == ':') {
+            char* v = line + n + 3;
+            while (*v == ' ' || *v == '\t') { v++; }
+            return v;
+        }
+    }
+    return NULL;
+}
+
+static char* json_value(char* body, const char* key) {
+    // the value of "key" in a flat json object, or NULL
+    size_t n = strlen(key);
+    for (char* p = strchr(body, '"'); p; p = strchr(p + 1, '"')) {
+        if (strncmp(p + 1, key, n) == 0 && p[n + 1] == '"') {
+            p += n + 2;
+            while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') { p++; }
+            if (*p != ':') { continue; }
+            p++;
+            while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') { p++; }
+            return p;
+        }
+    }
+    return NULL;
+}
+
+static long json_u16(char* p, char* end) {
+    // the utf-16 code unit of the \u escape whose u is at p, -1 unless exactly four hex digits follow
+    if (end - p < 5) { return -1; }
+    for (int i = 1; i <= 4; i++) { if (!isxdigit((unsigned char)p[i])) { return -1; } }
+    char hex[5] = { p[1], p[2], p[3], p[4], '\0' };
+    return strtol(hex, NULL, 16);
+}
+
+static char* json_string(char* p, char* end) {
+    // the json string at p, which must end before end, unescaped into a new buffer. \u escapes become
+    // utf-8, a surrogate pair one 4 byte character. NULL if p is no string, or a broken one
+    if (!p || p >= end || *p != '"') { return NULL; }
+    char* out = malloc(end - p + 1); // an escape never unescapes to more bytes than it takes
+    if (!out) { return NULL; }
+    char* o = out;
+    for (p++; p < end && *p != '"'; p++) {
+        if (*p != '\\') { *o++ = *p; continue; }
+        if (++p == end) { break; }
+        if (*p == 'n') { *o++ = '\n'; }
+        else if (*p == 't') { *o++ = '\t'; }
+        else if (*p == 'r') { *o++ = '\r'; }
+        else if (*p == 'b') { *o++ = '\b'; }
+        else if (*p == 'f') { *o++ = '\f'; }
+        else if (*p == 'u') {
+            long c = json_u16(p, end);
+            if (c < 0 || (c >= 0xdc00 && c <= 0xdfff)) { break; } // no hex, or a lone low surrogate
+            p += 4;
+            if (c >= 0xd800 && c <= 0xdbff) {
+                // a high surrogate, its low one must be the next escape: the pair is one code point
+                long lo = end - p > 2 && p[1] == '\\' && p[2] == 'u' ? json_u16(p + 2, end) : -1;
+                if (lo < 0xdc00 || lo > 0xdfff) { break; }
+                c = 0x10000 + ((c - 0xd800) << 10) + (lo - 0xdc00);
+                p += 6;
+            }
+            if (c < 0x80) { *o++ = c; }
+            else if (c < 0x800) { *o++ = 0xc0 | (c >> 6); *o++ = 0x80 | (c & 0x3f); }
+            else if (c < 0x10000) { *o++ = 0xe0 | (c >> 12); *o++ = 0x80 | ((c >> 6) & 0x3f); *o++ = 0x80 | (c & 0x3f); }
+            else {
+                *o++ = 0xf0 | (c >> 18); *o++ = 0x80 | ((c >> 12) & 0x3f);
+                *o++ = 0x80 | ((c >> 6) & 0x3f); *o++ = 0x80 | (c & 0x3f);
+            }
+        }
+        else if (*p == '"' || *p == '\\' || *p == '/') { *o++ = *p; }
+        else { break; }
+    }
+    if (p >= end || *p != '"') { free(out); return NULL; } // unterminated, or a bad escape
+    *o = '\0';
+    return out;
+}
+
+static int send_piece(Client* c, const char* piece) {
+    // one token as an event: data: {"content":"..."}, the piece escaped for json
+    char buf[64 + 6 * 64];
+    int n = sprintf(buf, "data: {\"content\":\"");
+    for (const unsigned char* p = (const unsigned char*)piece; *p && n < (int)sizeof(buf) - 16; p++) {
+        if (*p == '"' || *p == '\\') { n += sprintf(buf + n, "\\%c", *p); }
+        else if (*p == '\n') { n += sprintf(buf + n, "\\n"); }
+        else if (*p < 0x20) { n += sprintf(buf + n, "\\u%04x", *p); }
+        else { buf[n++] = *p; }
+    }
+    n += sprintf(buf + n, "\"}\n\n");
+    return client_send(c, buf, n);
+}
+
+static void client_end(Client* c, Batch* b) {
+    // the completion is over: its sequence leaves the batch, the connection may stay to flush
+    if (c->joined) { batch_leave(b, &c->seq); }
+    if (c->streaming) { free_sequence(&c->seq); }
+    free(c->prompt_tokens);
+    c->prompt_tokens = NULL;
+    c->joined = c->streaming = 0;
+}
+
+static void client_close(Client* c, Batch* b) {
+    client_end(c, b);
+    free(c->req);
+    free(c->out);
+    close(c->fd);
+    memset(c, 0, sizeof(*c));
+    c->fd = -1;
+}
+
+static int client_request(Client* c, char* end, int body_len, Transformer* t, Tokenizer* tokenizer, Sampler* sampler,
+                          float temperature, float topp, int steps) {
+    // act on the complete request in c->req, its head ending at end: start a completion, or answer.
+    // 0 if the client is gone
+    char* body = end + 4;
+    if (strncmp(c->req, "GET /health ", 12) == 0) { send_status(c, "200 OK", "ok\n"); return 1; }
+    if (strncmp(c->req, "POST /completion ", 17) != 0) { send_status(c, "404 Not Found", "POST /completion or GET /health\n"); return 1; }
+    // the request's sampling settings, the server's as defaults
+    body[body_len] = '\0'; // the json ends with the body, bytes sent after it are not part of it
+    char* v;
+    if ((v = json_value(body, "temperature"))) { temperature = atof(v); }
+    if ((v = json_value(body, "top_p"))) { topp = atof(v); }
+    if ((v = json_value(body, "steps"))) { steps = atoi(v); }
+    int topk = sampler->topk;
+    float minp = sampler->minp;
+    if ((v = json_value(body, "top_k"))) { topk = atoi(v); }
+    if ((v = json_value(body, "min_p"))) { minp = atof(v); }
+    if (temperature < 0.0) temperature = 0.0;
+    if (topp < 0.0 || 1.0 < topp) topp = 0.9;
+    if (topk < 0) topk = 0;
+    if (minp < 0.0 || 1.0 < minp) minp = 0.0;
+    if (steps <= 0 || (!t->state.kv.window && steps > t->config.seq_len)) { steps = t->config.seq_len; }
+    char* prompt = json_string(json_value(body, "prompt"), body + body_len);
+    if (!prompt) { send_status(c, "400 Bad Request", "a json body with a \"prompt\" string\n"); return 1; }
+    c->prompt_tokens = malloc((strlen(prompt) + 2) * sizeof(int));
+    int n = 0;
+    c->prompt_tokens[0] = 1; // BOS
+    encode(tokenizer, prompt, c->prompt_tokens + 1, &n);
+    free(prompt);
+
+    const char* head = "HTTP/1.1 200 OK\r\nContent-Type: text/event-stream\r\nCache-Control: no-cache\r\nConnection: close\r\n\r\n";
+    if (!client_send(c, head, strlen(head))) { return 0; }
+    malloc_sequence(&c->seq, t);
+    c->seq.pending = c->prompt_tokens;
+    c->seq.n_pending = n + 1 < steps ? n + 1 : steps;
+    c->streaming = 1;
+    c->prev = c->prompt_tokens[c->seq.n_pending - 1];
+    c->steps = steps;
+    c->temperature = temperature;
+    c->topp = topp;
+    c->topk = topk;
+    c->minp = minp;
+    c->rng = sampler->rng_state += 0x9e3779b97f4a7c15ull; // every request its own stream
+    c->start = time_in_ms();
+    return 1;
+}
+
+int serve(Transformer* t, Tokenizer* tokenizer, Sampler* sampler, int port, float temperature, float topp, int steps, int stats) {
+    // serve completions on port until killed. POST /completion takes a json body
+    // {"prompt": "...", "temperature": 0.8, "top_p": 0.9, "top_k": 40, "min_p": 0.05, "steps": 256},
+    // all but the prompt optional, and streams the tokens as data: {"content":"..."} events, then data: [DONE]
+    signal(SIGPIPE, SIG_IGN); // a client that went away is noticed by send()
+    int ls = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    setsockopt(ls, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if (ls == -1 || bind(ls, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(ls, SERVE_CLIENTS) != 0) {
+        fprintf(stderr, "could not listen on port %d\n", port);
+        return 1;
+    }
+    fcntl(ls, F_SETFL, fcntl(ls, F_GETFL) | O_NONBLOCK); // a connection gone before accept() must not block
+    if (stats) { fprintf(stderr, "serving on port %d\n", port); }
+    Client clients[SERVE_CLIENTS];
+    memset(clients, 0, sizeof(clients));
+    for (int i = 0; i < SERVE_CLIENTS; i++) { clients[i].fd = -1; }
+    Batch b;
+    build_batch(&b, &t->config);
+    struct pollfd fds[SERVE_CLIENTS + 1];
+    int who[SERVE_CLIENTS + 1];
+    while (1) {
+        // the network: new connections, request bytes and room for queued events. with sequences
+        // decoding, just a look
+        int nfds = 0;
+        fds[nfds].fd = ls;
+        fds[nfds++].events = POLLIN;
+        for (int i = 0; i < SERVE_CLIENTS; i++) {
+            if (clients[i].fd == -1) { continue; }
+            if (clients[i].closing && clients[i].out_len == 0) { client_close(&clients[i], &b); continue; }
+            // a streaming client has nothing more to say, but hangs up through POLLIN too
+            fds[nfds].fd = clients[i].fd;
+            fds[nfds].events = POLLIN | (clients[i].out_len ? POLLOUT : 0);
+            who[nfds++] = i;
+        }
+        if (poll(fds, nfds, b.n > 0 ? 0 : -1) < 0) { continue; }
+        if (fds[0].revents & POLLIN) {
+            int fd = accept(ls, NULL, NULL);
+            int i = 0;
+            while (i < SERVE_CLIENTS && clients[i].fd != -1) { i++; }
+            if (fd != -1 && i == SERVE_CLIENTS) {
+                // one try to say so, without waiting on the client
+                static const char busy[] = "HTTP/1.1 503 Service Unavailable\r\nContent-Type: text/plain\r\n"
+                                           "Content-Length: 5\r\nConnection: close\r\n\r\nbusy\n";
+                fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+                if (send(fd, busy, sizeof(busy) - 1, 0) < 0) { /* it gets the close */ }
+                close(fd);
+            } else if (fd != -1) {
+                fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)); // a token per packet
+                clients[i].fd = fd;
+                clients[i].req = malloc(SERVE_REQUEST + 1);
+            }
+        }
+        for (int k = 1; k < nfds; k++) {
+            Client* c = &clients[who[k]];
+            if ((fds[k].revents & POLLOUT) && !client_flush(c)) { client_close(c, &b); continue; }
+            if (!(fds[k].revents & (POLLIN | POLLHUP | POLLERR))) { continue; }
+            if (c->streaming || c->closing) {
+                char drop[256];
+                ssize_t got = recv(c->fd, drop, sizeof(drop), 0);
+                if (got == 0 || (got < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) { client_close(c, &b); }
+                continue;
+            }
+            ssize_t got = recv(c->fd, c->req + c->len, SERVE_REQUEST - c->len, 0);
+            if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) { continue; }
+            if (got <= 0) { client_close(c, &b); continue; }
+            c->len += got;
+            c->req[c->len] = '\0';
+            char* end = strstr(c->req, "\r\n\r\n");
+            if (!end) {
+                if (c->len == SERVE_REQUEST) { send_status(c, "413 Payload Too Large", "too large\n"); }
+                continue;
+            }
+            // wait for the whole body
+            char* cl = header_value(c->req, end, "Content-Length");
+            long body = cl ? strtol(cl, NULL, 10) : 0;
+            if (body < 0 || body > c->req + SERVE_REQUEST - (end + 4)) { send_status(c, "413 Payload Too Large", "too large\n"); continue; }
+            if (c->req + c->len < end + 4 + body) { continue; }
+            if (!client_request(c, end, body, t, tokenizer, sampler, temperature, topp, steps)) { client_close(c, &b); }
+        }
+
+        // the model: requests join as the batch has room, then one step for all of them
+        for (int i = 0; i < SERVE_CLIENTS; i++) {
+            if (clients[i].streaming && !clients[i].joined && batch_join(&b, &clients[i].seq)) { clients[i].joined = 1; }
+        }
+        if (b.n == 0) { continue; }
+        batch_step(&b, &t->config, &t->weights, &t->state);
+        for (int i = 0; i < SERVE_CLIENTS; i++) {
+            Client* c = &clients[i];
+            if (!c->joined || !c->seq.logits) { continue; }
+            // the request's own rng and filters, the server's stay the defaults of the next ones
+            Sampler own = *sampler;
+            own.rng_state = c->rng;
+            own.topk = c->topk;
+            own.minp = c->minp;
+            int next = sample(&own, c->seq.logits, c->temperature, c->topp);
+            c->rng = own.rng_state;
+            // the BOS (1) token delimits sequences
+            int done = next == 1;
+            if (!done) {
+                if (!send_piece(c, decode(tokenizer, c->prev, next))) { client_close(c, &b); continue; }
+                c->sent++;
+                c->prev = next;
+                done = c->seq.pos >= c->steps;
+            }
+            if (done) {
+                long ms = time_in_ms() - c->start;
+                if (stats) { fprintf(stderr, "completion: %d tokens in %ld ms, %d decoding\n", c->sent, ms, b.n); }
+                client_end(c, &b);
+                if (!client_send(c, "data: [DONE]\n\n", 14)) { client_close(c, &b); continue; }
+                c->closing = 1; // closed once the events are out, see the network part
+                continue;
+            }
+            c->next = next;
+            c->seq.pending = &c->next;
+            c->seq.n_pending = 1;
+        }
+    }
+    free_batch(&b);
+    close(ls);
+    return 0;
+}
+#endif
+
+// ----------------------------------------------------------------------------
+// libl2e (-D L2E_LIB, make lib): the api of l2e.h. a model holds the weights and the tokenizer,
+// read-only once open. a context holds everything a generation writes: run state, kv cache, sampler
+// and the rng in it. in THREADS builds the contexts share the one thread pool and take turns on it
+
+#ifdef L2E_LIB
+#include "l2e.h"
+
+struct L2EModel {
+    Transformer t; // its run state is the template of the contexts': rope table and kv cache setup
+    Tokenizer tokenizer;
+};
+
+struct L2EContext {
+    L2EModel* model;
+    RunState state;
+    Sampler sampler;
+    Tokenizer tokenizer; // the model's by value, decode() writes to byte_piece
+};
+
+static int l2e_models; // open models, the thread pool goes with the last one
+static pthread_mutex_t l2e_models_lock = PTHREAD_MUTEX_INITIALIZER; // of l2e_models, kernels and pool setup
+
+L2EModel* l2e_model_open(const char* checkpoint_path, const char* tokenizer_path, const L2EOptions* opt) {
+    // the loaders exit on a broken file, a missing one is the caller's to handle
+    FILE* f = fopen(checkpoint_path, "rb");
+    if (!f) { return NULL; }
+    fclose(f);
+    if (!(f = fopen(tokenizer_path, "rb"))) { return NULL; }
+    fclose(f);
+    L2EOptions o = { 0 };
+    if (opt) { o = *opt; }
+    if (o.kv_type < KV_FP32 || o.kv_type > KV_Q8) { o.kv_type = KV_FP32; }
+    pthread_mutex_lock(&l2e_models_lock);
+    if (l2e_models++ == 0) {
+        init_kernels();
+        #ifdef THREADS
+        pool_init(o.threads, SPIN_THEN_SLEEP, 0);
+        #endif
+    }
+    pthread_mutex_unlock(&l2e_models_lock);
+    L2EModel* m = calloc(1, sizeof(L2EModel));
+    m->t.seq_len = o.seq_len > 0 ? o.seq_len : 0;
+    m->t.rope_scaling = ROPE_NTK;
+    m->t.huge = PAGES_THP;
+    m->t.kv_type = o.kv_type;
+    m->t.sinks = o.sinks > 0 ? o.sinks : 0;
+    build_transformer(&m->t, (char*)checkpoint_path);
+    build_tokenizer(&m->tokenizer, (char*)tokenizer_path, m->t.config.vocab_size);
+    sort_vocab(&m->tokenizer); // now, encode() would sort it on a context's copy
+    return m;
+}
+
+void l2e_model_close(L2EModel* m) {
+    free_tokenizer(&m->tokenizer);
+    free_transformer(&m->t);
+    free(m);
+    pthread_mutex_lock(&l2e_models_lock);
+    if (--l2e_models == 0) {
+        #ifdef THREADS
+        pool_free();
+        #endif
+    }
+    pthread_mutex_unlock(&l2e_models_lock);
+}
+
+L2EContext* l2e_context_new(L2EModel* m, unsigned long long seed) {
+    Transformer* t = &m->t;
+    L2EContext* c = calloc(1, sizeof(L2EContext));
+    c->model = m;
+    malloc_run_state(&c->state, &t->config, t->huge, t->kv_type);
+    memcpy(c->state.rope, t->state.rope, (size_t)t->config.seq_len * (t->config.dim / t->config.n_heads) * sizeof(float));
+    c->state.kv.n_sink = t->state.kv.n_sink;
+    c->state.kv.window = t->state.kv.window;
+    build_sampler(&c->sampler, t->config.vocab_size, seed ? seed : (unsigned int)time(NULL));
+    c->tokenizer = m->tokenizer;
+    return c;
+}
+
+void l2e_context_free(L2EContext* c) {
+    free_sampler(&c->sampler);
+    free_run_state(&c->state);
+    free(c);
+}
+
+typedef struct {
+    L2ETokenFn on_token;
+    void* user;
+} L2EPieces;
+
+static int l2e_piece(const char* piece, int pos, int prompt, void* user) {
+    // the sampled pieces of generate() to the caller's callback, l2e_generate echoes no prompt
+    L2EPieces* o = user;
+    (void)pos; (void)prompt;
+    return o->on_token ? o->on_token(piece, o->user) : 0;
+}
+
+int l2e_generate(L2EContext* c, const char* prompt, int steps, float temperature, float topp,
+                 L2ETokenFn on_token, void* user) {
+    // the generation of run from BOS at position 0. the kv cache keeps its pages from the last call,
+    // nothing reads past pos
+    Transformer* t = &c->model->t;
+    Config* p = &t->config;
+    if (c->state.kv.window) { if (steps <= 0) steps = INT_MAX; }
+    else if (steps <= 0 || steps > p->seq_len) steps = p->seq_len;
+    if (temperature < 0.0f) temperature = 0.0f;
+    int* tokens = malloc((strlen(prompt ? prompt : "") + 1) * sizeof(int));
+    int n = 0;
+    if (prompt) { encode(&c->tokenizer, (char*)prompt, tokens, &n); }
+    int pos = 0;
+    int token = 1; // BOS, then the prompt
+    L2EPieces out = { .on_token = on_token, .user = user };
+    int generated = generate(p, &t->weights, &c->state, &c->tokenizer, &c->sampler, tokens, n, &pos, &token,
+                             steps, temperature, topp, 0, l2e_piece, &out);
+    free(tokens);
+    return generated;
+}
+#endif
+
 // ----------------------------------------------------------------------------
 // LLama 2 Everywhere read prompt utility function
 
@@ -1050,12 +4373,15 @@ void inprompt(char *lprompt) // Handle prompts
 // ----------------------------------------------------------------------------
 // int main
 
+#ifndef L2E_LIB // libl2e leaves main to its caller
 void error_usage() {
     fprintf(stderr, "Usage:   run <checkpoint> [options]\n");
     fprintf(stderr, "Example: run model.bin -n 256 -i \"Once upon a time\"\n");
     fprintf(stderr, "Options:\n");
     fprintf(stderr, "  -t <float>  temperature in [0,inf], default 1.0\n");
     fprintf(stderr, "  -p <float>  p value in top-p (nucleus) sampling in [0,1] default 0.9\n");
+    fprintf(stderr, "  -K <int>    k value in top-k sampling, default 0 = off\n");
+    fprintf(stderr, "  -M <float>  p value in min-p sampling in [0,1], relative to the most likely token, default 0 = off\n");
     fprintf(stderr, "  -s <int>    random seed, default time(NULL)\n");
     fprintf(stderr, "  -n <int>    number of steps to run for, default 256. 0 = max_seq_len\n");
     fprintf(stderr, "  -b <int>    number of tokens to buffer, default 1. 0 = max_seq_len\n");
@@ -1063,9 +4389,47 @@ void error_usage() {
     fprintf(stderr, "  -i <string> input prompt\n");
     fprintf(stderr, "  -z <string> optional path to custom tokenizer\n");
     fprintf(stderr, "  -e <string> optional path to training data\n");
+    fprintf(stderr, "  -f <int>    fuse wq/wk/wv into one matrix at load time, default 0 = off. 1 = on\n");
+    fprintf(stderr, "  -L <int>    repack the weights into panels for the SIMD kernels, cached in <checkpoint>.panels, default 0 = off. 1 = on\n");
+    fprintf(stderr, "  -c <int>    context length, default 0 = the trained one\n");
+    fprintf(stderr, "  -r <int>    rope scaling above the trained context, 0 = none, 1 = linear, default 2 = ntk\n");
+    fprintf(stderr, "  -j <int>    number of threads, default 0 = one per cpu (THREADS builds), OMP_NUM_THREADS (OpenMP builds)\n");
+    fprintf(stderr, "  -y <int>    how idle pool threads wait, 0 = sleep, default 1 = spin then sleep, 2 = spin\n");
+    fprintf(stderr, "  -u <int>    spread threads and weight rows over the numa nodes, default 1 = on (NUMA builds). 0 = off\n");
+    fprintf(stderr, "  -H <int>    huge pages, 0 = off, default 1 = transparent for the run state, 2 = hugetlb, weights copied too\n");
+    fprintf(stderr, "  -w <int>    page the weights in at load, default 0 = off, 1 = read ahead in the background, 2 = read now, all threads\n");
+    fprintf(stderr, "  -m <int>    lock the weights and run state in memory, default 0 = off. 1 = on\n");
+    fprintf(stderr, "  -q <int>    kv cache storage, default 0 = fp32. 1 = fp16, 2 = int8\n");
+    fprintf(stderr, "  -S <int>    stream past the context length, keeping this many attention sink tokens, default 0 = off\n");
+    fprintf(stderr, "  -k <string> session file: resume its context if it matches the checkpoint, save the context to it at the end\n");
+    fprintf(stderr, "  -B <int>    decode this many samples of the prompt together in one batch, default 1\n");
+    fprintf(stderr, "  -N <int>    n-best: prefill the prompt once and decode this many candidates from it in one batch, default 0 = off\n");
+    #ifdef SERVER
+    fprintf(stderr, "  --serve <port>  http server: POST /completion streams tokens as server-sent events\n");
+    #endif
     exit(EXIT_FAILURE);
 }
 
+typedef struct {
+    int buffertokens; // -b
+    int flush_at;     // position of the next flush of stdout
+    int echoed;       // the echoed prompt is not flushed yet
+    long start;       // time of the first sampled token, the tok/s count from its position
+    int start_pos;
+} CliOutput;
+
+int print_piece(const char* piece, int pos, int prompt, void* user) {
+    // run's stdout: the echoed prompt is flushed at once, the sampled tokens every buffertokens
+    CliOutput* o = user;
+    if (!prompt && o->echoed) { fflush(stdout); o->echoed = 0; }
+    printf("%s", piece);
+    if (prompt) { o->echoed = 1; o->flush_at = pos + o->buffertokens; return 0; }
+    if (o->flush_at == pos) { fflush(stdout); o->flush_at += o->buffertokens; }
+    // init the timer here because the first iteration can be slower
+    if (o->start == 0) { o->start = time_in_ms(); o->start_pos = pos; }
+    return 0;
+}
+
 int enzyme_const;
 int enzyme_primal_return;
 int enzyme_dup;
@@ -1086,12 +4450,30 @@ int main(int argc, char *argv[]) {
     char *tokenizer_path = "tokenizer.bin";
     float temperature = 1.0f; // 0.0 = greedy deterministic. 1.0 = original. don't set higher
     float topp = 0.9f;        // top-p in nucleus sampling. 1.0 = off. 0.9 works well, but slower
-    rng_seed = 0; // seed rng with time by default
+    int topk = 0;             // top-k sampling, 0 = off
+    float minp = 0.0f;        // min-p sampling, relative to the most likely token. 0 = off
+    unsigned long long rng_seed = 0; // seed rng with time by default
     int steps = 256;          // number of steps to run for
     char *prompt = NULL;      // prompt string
     int buffertokens = 1;     // output token buffer size
     int stats = 1;     // extended status info
     char *training_data = "trains.txt";
+    int fuse = 0;      // fuse the qkv matmuls at load time
+    int repack = 0;    // repack the weights into panels at load time
+    int context = 0;   // context length, 0 = the trained one
+    int rope_scaling = ROPE_NTK; // how to stretch rope to a longer context
+    int threads = 0;   // worker threads, 0 = the default of the build
+    int spin = 1;      // thread pool wait policy
+    int numa = 1;      // numa placement, NUMA builds only
+    int huge = PAGES_THP; // page backing of the run state (and weights)
+    int warmup = WARMUP_NONE; // page the weights in at load
+    int lock = 0;      // mlock the weights and run state
+    int kv_type = KV_FP32; // storage of the kv cache
+    int sinks = 0;     // streaming generation, attention sink tokens
+    char *session_path = NULL; // session snapshot to resume from and save to
+    int batch = 1;     // sequences decoded together
+    int nbest = 0;     // candidates forked from one prefill of the prompt, 0 = off
+    int serve_port = 0; // --serve: http server on this port, 0 = off
     
     
     #if defined(COSMO_ZIP) || defined(INC_BIN) || defined(STRLIT) // special case for embedded models
@@ -1108,25 +4490,29 @@ int main(int argc, char *argv[]) {
     tokenizer_path = emb_Tokenizer_data;
     #endif
     buffertokens=8;
+    #ifdef SINKS
+    sinks = SINKS; // kiosks generate past the context, see -S
+    #endif
     #ifdef LLOOP
     stats = LOOPSTATUS;
-    while(1) { // start of loop
     #endif
     prompt=(char*)malloc(1024);
-    printf("\n" DEFTOSTR(OSPROMPT)" ");
-    fflush(stdout); 
-    inprompt(prompt); // read prompt
     #else
     // poor man's C argparse so we can override the defaults above from the command line
     if (argc >= 2) { checkpoint_path = argv[1]; } else { error_usage(); }
     for (int i = 2; i < argc; i+=2) {
         // do some basic validation
         if (i + 1 >= argc) { error_usage(); } // must have arg after flag
+        #ifdef SERVER
+        if (strcmp(argv[i], "--serve") == 0) { serve_port = atoi(argv[i + 1]); continue; }
+        #endif
         if (argv[i][0] != '-') { error_usage(); } // must start with dash
         if (strlen(argv[i]) != 2) { error_usage(); } // must be -x (one dash, one letter)
         // read in the args
         if (argv[i][1] == 't') { temperature = atof(argv[i + 1]); }
         else if (argv[i][1] == 'p') { topp = atof(argv[i + 1]); }
+        else if (argv[i][1] == 'K') { topk = atoi(argv[i + 1]); }
+        else if (argv[i][1] == 'M') { minp = atof(argv[i + 1]); }
         else if (argv[i][1] == 's') { rng_seed = atoi(argv[i + 1]); }
         else if (argv[i][1] == 'n') { steps = atoi(argv[i + 1]); }
         else if (argv[i][1] == 'b') { buffertokens = atoi(argv[i + 1]); }
@@ -1134,6 +4520,21 @@ int main(int argc, char *argv[]) {
         else if (argv[i][1] == 'i') { prompt = argv[i + 1]; }
         else if (argv[i][1] == 'z') { tokenizer_path = argv[i + 1]; }
         else if (argv[i][1] == 'e') { training_data = argv[i + 1]; } // Enzyme!
+        else if (argv[i][1] == 'f') { fuse = atoi(argv[i + 1]); }
+        else if (argv[i][1] == 'L') { repack = atoi(argv[i + 1]); }
+        else if (argv[i][1] == 'c') { context = atoi(argv[i + 1]); }
+        else if (argv[i][1] == 'r') { rope_scaling = atoi(argv[i + 1]); }
+        else if (argv[i][1] == 'j') { threads = atoi(argv[i + 1]); }
+        else if (argv[i][1] == 'y') { spin = atoi(argv[i + 1]); }
+        else if (argv[i][1] == 'u') { numa = atoi(argv[i + 1]); }
+        else if (argv[i][1] == 'H') { huge = atoi(argv[i + 1]); }
+        else if (argv[i][1] == 'w') { warmup = atoi(argv[i + 1]); }
+        else if (argv[i][1] == 'm') { lock = atoi(argv[i + 1]); }
+        else if (argv[i][1] == 'q') { kv_type = atoi(argv[i + 1]); }
+        else if (argv[i][1] == 'S') { sinks = atoi(argv[i + 1]); }
+        else if (argv[i][1] == 'k') { session_path = argv[i + 1]; }
+        else if (argv[i][1] == 'B') { batch = atoi(argv[i + 1]); }
+        else if (argv[i][1] == 'N') { nbest = atoi(argv[i + 1]); }
         else { error_usage(); }
     }
     #endif
@@ -1142,34 +4543,105 @@ int main(int argc, char *argv[]) {
     if (rng_seed <= 0) rng_seed = (unsigned int)time(NULL);
     if (temperature < 0.0) temperature = 0.0;
     if (topp < 0.0 || 1.0 < topp) topp = 0.9;
+    if (topk < 0) topk = 0;
+    if (minp < 0.0 || 1.0 < minp) minp = 0.0;
     if (steps <= 0) steps = 0;
+    if (rope_scaling < ROPE_NONE || rope_scaling > ROPE_NTK) rope_scaling = ROPE_NTK;
+    if (huge < PAGES_4K || huge > PAGES_HUGETLB) huge = PAGES_THP;
+    if (warmup < WARMUP_NONE || warmup > WARMUP_TOUCH) warmup = WARMUP_NONE;
+    if (kv_type < KV_FP32 || kv_type > KV_Q8) kv_type = KV_FP32;
+    if (sinks < 0) sinks = 0;
+    if (batch < 1 || batch > PREFILL_BATCH) batch = batch < 1 ? 1 : PREFILL_BATCH;
+    if (nbest < 0 || nbest > PREFILL_BATCH) nbest = nbest < 0 ? 0 : PREFILL_BATCH;
+    if (nbest > 0) batch = nbest; // the n candidates are a batch that shares the prefill
+    if (session_path && (batch > 1 || serve_port)) {
+        // a session is one kv cache, the batch and the server have one per sequence
+        fprintf(stderr, "-k is ignored with %s, no session is resumed or saved\n",
+                serve_port ? "--serve" : nbest > 0 ? "-N" : "-B");
+        session_path = NULL;
+    }
+
+    // pick the matmul kernels for this cpu
+    init_kernels();
+
+    // start the worker threads
+    #ifdef THREADS
+    if (spin < SPIN_SLEEP || spin > SPIN_ALWAYS) spin = SPIN_THEN_SLEEP;
+    pool_init(threads, spin, numa);
+    #else
+    (void)spin; // only the thread pool has a wait policy
+    (void)numa;
+    #ifdef _OPENMP
+    if (threads > 0) omp_set_num_threads(threads);
+    #endif
+    (void)threads;
+    #endif
 
     // build the Transformer via the model .bin file
-    Transformer transformer;
+    long load_start = time_in_ms(); // startup is timed separately from generation
+    Transformer transformer = {0};
+    transformer.fuse_qkv = fuse;
+    transformer.repack = repack;
+    transformer.seq_len = context;
+    transformer.rope_scaling = rope_scaling;
+    transformer.numa = numa;
+    transformer.huge = huge;
+    transformer.warmup = warmup;
+    transformer.mlock = lock;
+    transformer.kv_type = kv_type;
+    transformer.sinks = sinks;
+    transformer.stats = stats;
     build_transformer(&transformer, checkpoint_path);
 
+    int token = 1;   // init with token 1 (=BOS), as done in Llama-2 sentencepiece tokenizer
+    int pos = 0;     // position in the sequence
+    if (session_path) {
+        // resume the context of the session, if it was saved with this checkpoint and these settings
+        if (load_session(&transformer, session_path, &pos, &token, &rng_seed)) {
+            if (stats) { fprintf(stderr, "session: resumed at position %d\n", pos); }
+        } else if (stats) { fprintf(stderr, "session: nothing to resume in %s, starting over\n", session_path); }
+    }
+    // steps run on from a resumed position
+    if (transformer.state.kv.window) {
+        // streaming runs for as many steps as asked, 0 = until the model ends the sequence
+        if (steps == 0 || steps > INT_MAX - pos) steps = INT_MAX; else steps += pos;
+    } else if (steps == 0 || steps > transformer.config.seq_len - pos) steps = transformer.config.seq_len; // override to ~max length
+    else steps += pos;
+
     // build the Tokenizer via the tokenizer .bin file
     Tokenizer tokenizer;
     build_tokenizer(&tokenizer, tokenizer_path, transformer.config.vocab_size);
 
     // build the Sampler
     Sampler sampler;
-    build_sampler(&sampler, transformer.config.vocab_size);
-
-    // encode the (string) prompt into tokens sequence, if any is given
-    int *prompt_tokens = NULL; // the sequence of prompt tokens
-    int num_prompt_tokens = 0; // the total number of prompt tokens
-    if (prompt != NULL) {
-        prompt_tokens = (int*)malloc((strlen(prompt)+1) * sizeof(int));
-        encode(&tokenizer, prompt, prompt_tokens, &num_prompt_tokens);
+    build_sampler(&sampler, transformer.config.vocab_size, rng_seed);
+    sampler.topk = topk;
+    sampler.minp = minp;
+    long load_end = time_in_ms();
+
+    #ifdef SERVER
+    if (serve_port > 0) {
+        // t, p and n are the defaults of the requests, unbounded streams stop at the context length
+        return serve(&transformer, &tokenizer, &sampler, serve_port, temperature, topp,
+                     steps == INT_MAX ? transformer.config.seq_len : steps, stats);
+    }
+    #endif
+    (void)serve_port;
+
+    if (batch > 1) {
+        // the samples are kept until all are done, so an unbounded stream stops at the context length
+        generate_batch(&transformer, &tokenizer, &sampler, prompt, steps == INT_MAX ? transformer.config.seq_len : steps,
+                       temperature, topp, batch, nbest > 0, stats);
+        if (stats && huge) { report_pages(&transformer); }
+        free_sampler(&sampler);
+        free_tokenizer(&tokenizer);
+        free_transformer(&transformer);
+        #ifdef THREADS
+        pool_free();
+        #endif
+        return 0;
     }
 
-    // start the main loop
-    long start = 0;  // used to time our code, only initialized after first iteration
-    int next;        // will store the next token in the sequence
-    int token = 1;   // init with token 1 (=BOS), as done in Llama-2 sentencepiece tokenizer
-    int pos = 0;     // position in the sequence
-    int bufferflush = 1; // token counter for flushing buffer
     static char outbuff[4096 * (6 + 2)] ; // buffersize is context length * average size of subwords + margin
     
     // Todo: we can do buffering without setvbuff, implement that
@@ -1241,7 +4713,7 @@ int main(int argc, char *argv[]) {
             // printf("%s %d %f\n", nexttok == -1 ? "<INVALID>" : tokenizer.vocab[nexttok], pos, lres);
             // fflush(stdout);
 
-            for (size_t i =0, end=(transformer.file_size - sizeof(Config))/sizeof(float); i<end; i++) {
+            for (size_t i =0, end=(transformer.file_size - ((char*)transformer.weights_ptr - (char*)transformer.data))/sizeof(float); i<end; i++) {
                 //if (fabs(transformer.dweights_ptr[i]) > 1000 || isnan(transformer.dweights_ptr[i])) {
                 //    printf("%i %f\n", i, transformer.dweights_ptr[i]);
                 //    exit(1);
@@ -1269,6 +4741,33 @@ int main(int argc, char *argv[]) {
     }
 #endif // AD
 
+    #if defined(COSMO_ZIP) || defined(INC_BIN) || defined(STRLIT)
+    #ifdef LLOOP
+    // the model, tokenizer (with its sorted vocab) and sampler stay resident across prompts,
+    // only the positions start over. the kv cache keeps its pages, nothing reads past pos
+    int prompts = 0;
+    while(1) { // start of loop
+    token = 1;
+    pos = 0;
+    #endif
+    printf("\n" DEFTOSTR(OSPROMPT)" ");
+    fflush(stdout); 
+    inprompt(prompt); // read prompt
+    #endif
+    long setup_start = time_in_ms(); // per prompt setup, up to the first token
+
+    // encode the (string) prompt into tokens sequence, if any is given
+    int *prompt_tokens = NULL; // the sequence of prompt tokens
+    int num_prompt_tokens = 0; // the total number of prompt tokens
+    if (prompt != NULL) {
+        prompt_tokens = (int*)malloc((strlen(prompt)+1) * sizeof(int));
+        encode(&tokenizer, prompt, prompt_tokens, &num_prompt_tokens);
+    }
+    long setup_end = time_in_ms();
+
+    // start the main loop
+    CliOutput out = { .buffertokens = buffertokens, .flush_at = pos + buffertokens };
+
     // free_run_state(&state);
     // malloc_run_state(&state, &config);
 
@@ -1296,55 +4795,52 @@ int main(int argc, char *argv[]) {
 
     // }
 
-    while (pos < steps) {
-
-        // forward the transformer to get logits for the next token
-        float* logits = forward(token, pos, &transformer.config, &transformer.weights, &transformer.state);
-        //float* logits = forward(&transformer, token, pos);
-        //Config* p = &transformer->config;
-        //TransformerWeights* w = &transformer->weights;
-        //RunState* s = &transformer->state;
-
-        // advance the state state machine
-        if (pos < num_prompt_tokens) {
-            // if we are still processing the input prompt, force the next prompt token
-            next = prompt_tokens[pos];
-        } else {
-            // otherwise sample the next token from the logits
-            next = sample(&sampler, logits, temperature, topp);
-        }
-        pos++;
-
-        // data-dependent terminating condition: the BOS (1) token delimits sequences
-        if (next == 1) { break; }
-
-        // print the token as string, decode it with the Tokenizer object
-        char* piece = decode(&tokenizer, token, next);
-        printf("%s", piece);
-        if (bufferflush==pos) { fflush(stdout); bufferflush+=buffertokens; } 
-        token = next;
-
-        // init the timer here because the first iteration can be slower
-        if (start == 0) { start = time_in_ms(); }
-    }
+    // prefill BOS (or a resumed session's next token) and the prompt, then sample until steps or BOS
+    generate(&transformer.config, &transformer.weights, &transformer.state, &tokenizer, &sampler,
+             prompt_tokens, num_prompt_tokens, &pos, &token, steps, temperature, topp, 1, print_piece, &out);
     printf("\n");
     fflush(stdout); // This could be in the if next break, and the print new line prepended to achieved tok/s
-    // report achieved tok/s (pos-1 because the timer starts after first iteration)
-    if (pos > 1) {
+    // report the startup: loading, then the prompt prefill up to the first generated token
+    if (stats) {
+        #if defined(LLOOP) && (defined(COSMO_ZIP) || defined(INC_BIN) || defined(STRLIT))
+        if (prompts++ > 0) {
+            // what a rebuild of the model, tokenizer and sampler for this prompt would have added
+            fprintf(stderr, "prompt setup: %ld ms, load of %ld ms skipped\n", setup_end - setup_start, load_end - load_start);
+        } else
+        #endif
+        fprintf(stderr, "load: %ld ms, prompt setup: %ld ms\n", load_end - load_start, setup_end - setup_start);
+        if (out.start) { fprintf(stderr, "time to first token: %ld ms\n", out.start - setup_start); }
+        // the kv cache only holds the pages generation reached
+        static const char* kv_names[] = { "fp32", "fp16", "int8" };
+        KVCache* kv = &transformer.state.kv;
+        fprintf(stderr, "kv cache: %d of %d pages, %.1f MB as %s\n", kv->n_alloc, kv->n_pages,
+                kv->n_alloc * kv_page_bytes(kv) / 1048576.0, kv_names[kv->type]);
+        if (huge) { report_pages(&transformer); }
+    }
+    // report achieved tok/s (from start_pos because the timer starts after first iteration)
+    if (out.start && pos > out.start_pos) {
         long end = time_in_ms();
-        if(stats){ fprintf(stderr, "achieved tok/s: %f\n", (pos-1) / (double)(end-start)*1000); } 
+        if(stats){ fprintf(stderr, "achieved tok/s: %f\n", (pos-out.start_pos) / (double)(end-out.start)*1000); } 
     }
 
-    // memory and file handles cleanup
+    // snapshot the context to resume it next time: the cache holds positions up to pos, token goes in at pos
+    if (session_path) { save_session(&transformer, session_path, pos, token, sampler.rng_state); }
+
     if (prompt_tokens != NULL) { free(prompt_tokens); }
-    free_sampler(&sampler);
-    free_tokenizer(&tokenizer);
-    free_transformer(&transformer);
     #if defined(COSMO_ZIP) || defined(INC_BIN) || defined(STRLIT)
     #ifdef LLOOP
     printf("\n");
     } // end of loop
     #endif
     #endif    
+
+    // memory and file handles cleanup
+    free_sampler(&sampler);
+    free_tokenizer(&tokenizer);
+    free_transformer(&transformer);
+    #ifdef THREADS
+    pool_free();
+    #endif
     return 0;
 }
+#endif // L2E_LIB